@@ -0,0 +1,3 @@
+#!/bin/sh
+
+g++ -std=c++17 -fopenmp -O2 -o dbpf-recompress dbpf-recompress.cpp
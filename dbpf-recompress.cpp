@@ -1,28 +1,436 @@
 #include "dbpf.h"
+#include "ioengine.h"
 
-#include <fcntl.h>
-#include <io.h>
+#ifdef _WIN32
+	#include <fcntl.h>
+	#include <io.h>
+#endif
 
+#include <chrono>
+#include <clocale>
+#include <cwchar>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <vector>
 
 using namespace std;
 
-bool validatePackage(dbpf::Package& oldPackage, dbpf::Package& newPackage, fstream& oldFile, fstream& newFile, wstring displayPath, dbpf::Mode mode);
+//how much smaller a package has to get for it to be replaced, in bytes and in percent of the old size
+struct MinimumGain {
+	size_t bytes = 0;
+	double percent = 0;
+};
+
+template<class FileType>
+dbpf::Package readPackage(FileType& file, wstring displayPath, dbpf::Mode mode);
+
+template<class FileType, class TempFileType>
+bool processPackage(FileType& file, TempFileType& tempFile, dbpf::Package& package, filesystem::path fileName, wstring displayPath, dbpf::Mode mode, bool fastDecode, size_t budget, bool direct, MinimumGain minGain, const dbpf::Ordering& ordering);
+
+template<class FileType, class TempFileType>
+bool validatePackage(dbpf::Package& package, dbpf::PackageLayout& layout, FileType& oldFile, TempFileType& newFile, wstring displayPath, dbpf::Mode mode, size_t budget);
 
 //trys to delete a file, fails silently
-void tryDelete(wstring fileName) {
+void tryDelete(filesystem::path fileName) {
 	try { filesystem::remove(fileName); }
-	catch(filesystem::filesystem_error) {}
+	catch(const filesystem::filesystem_error&) {}
+}
+
+//replace the old file with the new one
+template<class FileType>
+bool replaceFile(FileType& tempFile, filesystem::path tempFileName, filesystem::path fileName) {
+	tempFile.close();
+	
+	try {
+		filesystem::rename(tempFileName, fileName);
+	}
+	
+	catch(const filesystem::filesystem_error&) {
+		tryDelete(tempFileName);
+		return false;
+	}
+	
+	return true;
+}
+
+//packages built in memory are written out by the caller (saveFile or the I/O engine), the new content stays in tempFile until then
+bool replaceFile(dbpf::MemoryFile&, filesystem::path, filesystem::path) {
+	return true;
+}
+
+//write a package that was put together in memory to the temp file with one write, then replace the old file with it
+bool saveFile(dbpf::MemoryFile& tempFile, filesystem::path tempFileName, filesystem::path fileName, bool direct) {
+	dbpf::File file;
+	bool success = file.create(tempFileName, tempFile.size(), direct) && file.write(0, tempFile.size(), tempFile.data());
+	tempFile.close();
+	
+	if(!success) {
+		file.close();
+		tryDelete(tempFileName);
+		return false;
+	}
+	
+	return replaceFile(file, tempFileName, fileName);
+}
+
+/*add the compressor signature to a package that is kept as it is, see dbpf::putSignature
+a journal with the old file size and hole index info is written next to the package first
+if the program stops halfway then recoverFile puts the package back the way it was on the next run*/
+bool stampFile(filesystem::path fileName, uint fileSize) {
+	filesystem::path journalName = fileName;
+	journalName += ".journal";
+	
+	dbpf::File package;
+	bytes journal = bytes(20);
+	uint pos = 0;
+	
+	dbpf::putInt(journal, pos, dbpf::SIGNATURE);
+	dbpf::putInt(journal, pos, fileSize);
+	
+	if(!package.open(fileName, true) || !package.read(48, 12, journal.data() + pos)) {
+		return false;
+	}
+	
+	dbpf::File journalFile;
+	bool success = journalFile.create(journalName, journal.size()) && journalFile.write(0, journal.size(), journal.data()) && journalFile.sync();
+	journalFile.close();
+	
+	if(!success) {
+		tryDelete(journalName);
+		return false;
+	}
+	
+	success = dbpf::putSignature(package, fileSize);
+	
+	//put the package back right away, the journal is kept if that fails too
+	if(!success && !(package.resize(fileSize) && package.write(48, 12, journal.data() + pos) && package.sync())) {
+		return false;
+	}
+	
+	package.close();
+	tryDelete(journalName);
+	return success;
+}
+
+//undo a stampFile that didn't finish, nothing happens if there is no journal for the package
+void recoverFile(filesystem::path fileName) {
+	filesystem::path journalName = fileName;
+	journalName += ".journal";
+	
+	error_code error;
+	
+	if(!filesystem::exists(journalName, error)) {
+		return;
+	}
+	
+	dbpf::File journalFile;
+	bytes journal = bytes(20);
+	bool complete = journalFile.open(journalName) && journalFile.size() == journal.size() && journalFile.read(0, journal.size(), journal.data());
+	journalFile.close();
+	
+	uint pos = 0;
+	uint signature = dbpf::getInt(journal, pos);
+	uint fileSize = dbpf::getInt(journal, pos);
+	
+	//if the journal wasn't written in full then the package wasn't changed yet
+	if(complete && signature == dbpf::SIGNATURE) {
+		dbpf::File package;
+		
+		if(!package.open(fileName, true)) {
+			return;
+		}
+		
+		//the package is only put back if it was changed by stampFile and nothing else
+		size_t size = package.size();
+		
+		if(size >= fileSize && size <= fileSize + 16
+		&& !(package.resize(fileSize) && package.write(48, 12, journal.data() + pos) && package.sync())) {
+			return;
+		}
+	}
+	
+	tryDelete(journalName);
+}
+
+//compress or decompress one package and replace the old file with the new one
+//new packages of up to stagingSize bytes are put together and validated in memory, and written to disk at once at the end
+//new files are written past the system's cache if direct is set and the file system allows it
+template<class FileType>
+bool processFile(FileType& file, filesystem::path fileName, wstring displayPath, dbpf::Mode mode, bool fastDecode, size_t stagingSize, size_t budget, bool direct, MinimumGain minGain, const dbpf::Ordering& ordering) {
+	dbpf::Package package = readPackage(file, displayPath, mode);
+	
+	//this goes by the size of the new package, decompressing can make it many times larger than the old file
+	if(package.unpacked && dbpf::getMaxPackageSize(file, package, mode, budget) > stagingSize) {
+		FileType tempFile;
+		return processPackage(file, tempFile, package, fileName, displayPath, mode, fastDecode, budget, direct, minGain, ordering);
+	}
+	
+	dbpf::MemoryFile tempFile;
+	
+	if(!processPackage(file, tempFile, package, fileName, displayPath, mode, fastDecode, budget, direct, minGain, ordering)) {
+		return false;
+	}
+	
+	//the package was skipped
+	if(!tempFile.is_open()) {
+		return true;
+	}
+	
+	filesystem::path tempFileName = fileName;
+	tempFileName += ".new";
+	
+	if(!saveFile(tempFile, tempFileName, fileName, direct)) {
+		wcout << displayPath << L": Failed to overwrite file" << endl;
+		return false;
+	}
+	
+	return true;
 }
 
+//output the file size before and after to the console
+void printSizes(wstring displayPath, float current_size, float new_size) {
+	wcout << displayPath << L" " << fixed << setprecision(2);
+	
+	if(current_size >= 1000) {
+		wcout << current_size / 1024.0 << L" MB";
+	} else {
+		wcout << current_size << L" KB";
+	}
+	
+	wcout << " -> ";
+	
+	if(new_size >= 1000) {
+		wcout << new_size / 1024.0 << L" MB";
+	} else {
+		wcout << new_size << L" KB";
+	}
+	
+	wcout << endl;
+}
+
+#ifdef __linux__
+void processWithEngine(vector<filesystem::directory_entry>& files, vector<wstring>& displayPaths, dbpf::Mode mode, bool fastDecode, bool useRing, size_t budget, MinimumGain minGain, const dbpf::Ordering& ordering);
+#endif
+
+template<class FileType>
+bool mergePackages(vector<filesystem::path>& paths, vector<wstring>& displayPaths, filesystem::path outputPath, dbpf::Mode mode, bool fastDecode, size_t budget, const dbpf::Ordering& ordering);
+
+int run(vector<filesystem::path> argv);
+
+#ifdef _WIN32
+
 //using wide chars and wide strings to support UTF-16 file names
 int wmain(int argc, wchar_t *argv[]) {
 	_setmode(_fileno(stdout), _O_U16TEXT); //fix for wcout
+	return run(vector<filesystem::path>(argv, argv + argc));
+}
+
+//file name for printing to the console
+wstring getDisplayName(filesystem::path path) {
+	return path.wstring();
+}
+
+#else
+
+//file names are UTF-8 outside of Windows, they are kept as they are and only converted to wide strings for printing
+int main(int argc, char *argv[]) {
+	setlocale(LC_CTYPE, "C.UTF-8"); //fix for wcout
+	return run(vector<filesystem::path>(argv, argv + argc));
+}
+
+//file name for printing to the console, bytes that are not valid UTF-8 are replaced with '?'
+wstring getDisplayName(filesystem::path path) {
+	string name = path.string();
+	wstring displayName;
+	mbstate_t state = mbstate_t();
+	
+	for(size_t pos = 0; pos < name.size();) {
+		wchar_t c;
+		size_t length = mbrtowc(&c, name.data() + pos, name.size() - pos, &state);
+		
+		if(length == (size_t) -1 || length == (size_t) -2) {
+			c = L'?';
+			length = 1;
+			state = mbstate_t();
+		}
+		
+		displayName += c;
+		pos += max(length, (size_t) 1);
+	}
+	
+	return displayName;
+}
+
+#endif
+
+//read a trace of the resources the game loads, one "type group instance [resource]" in hex per line, lines starting with # are skipped
+bool readTrace(filesystem::path path, vector<dbpf::Tgir>& trace) {
+	ifstream file(path);
+	
+	if(!file.is_open()) {
+		wcout << getDisplayName(path) << L": Failed to open file" << endl;
+		return false;
+	}
+	
+	string line;
+	
+	for(uint lineNumber = 1; getline(file, line); lineNumber++) {
+		if(line.find_first_not_of(" \t\r") == string::npos || line[0] == '#') {
+			continue;
+		}
+		
+		istringstream fields(line);
+		string type, group, instance, resource = "0";
+		
+		try {
+			if(!(fields >> type >> group >> instance)) {
+				throw invalid_argument(line);
+			}
+			
+			fields >> resource;
+			trace.push_back(dbpf::Tgir{(uint) stoul(type, nullptr, 16), (uint) stoul(group, nullptr, 16), (uint) stoul(instance, nullptr, 16), (uint) stoul(resource, nullptr, 16)});
+		}
+		
+		catch(const logic_error&) {
+			wcout << getDisplayName(path) << L": Invalid line " << lineNumber << endl;
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+/*read the entries of a package the way the game loads them, one read per entry, and print how scattered the reads are
+entries are read in the order of the trace if there is one, otherwise in the order of the key, or group by group like the game loads an object
+the package is dropped from the system's cache first so that the reads go to the disk, nothing is changed
+running it before and after laying out a package with -o or -t shows what the new layout saves*/
+void replayPackage(filesystem::path fileName, wstring displayPath, const dbpf::Ordering& ordering) {
+	dbpf::File file;
+	
+	if(!file.open(fileName)) {
+		wcout << displayPath << L": Failed to open file" << endl;
+		return;
+	}
+	
+	dbpf::Package package = dbpf::getPackage(file, displayPath, dbpf::SKIP);
+	
+	if(!package.unpacked) {
+		return;
+	}
+	
+	vector<uint> order;
+	
+	if(!ordering.trace.empty()) {
+		dbpf::TgirMap lookup;
+		lookup.reserve(package.entries.size());
+		
+		for(uint i = 0; i < package.entries.size(); i++) {
+			lookup.insert(dbpf::getTgir(package.entries[i]), i);
+		}
+		
+		for(auto& tgir: ordering.trace) {
+			const uint* i = lookup.find(tgir);
+			
+			if(i != nullptr) {
+				order.push_back(*i);
+			}
+		}
+	} else {
+		order = dbpf::getWriteOrder(package.entries, dbpf::Ordering{ordering.key.empty() ? "gti" : ordering.key});
+	}
+	
+	file.advise(dbpf::DONT_NEED);
+	
+	uint seeks = 0;
+	uint64_t distance = 0;
+	uint64_t position = 96; //where the last read ended
+	auto start = chrono::steady_clock::now();
+	
+	for(uint i: order) {
+		auto& entry = package.entries[i];
+		auto content = dbpf::readFile(file, entry.location, entry.size);
+		
+		if(entry.location != position) {
+			seeks++;
+			distance += entry.location > position ? entry.location - position : position - entry.location;
+		}
+		
+		position = (uint64_t) entry.location + entry.size;
+	}
+	
+	double time = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	
+	wcout << displayPath << L": " << order.size() << L" reads, " << seeks << L" seeks, " << fixed << setprecision(2);
+	wcout << distance / (1024.0 * 1024.0) << L" MB skipped, " << time << L" ms" << endl;
+}
+
+/*walk the commands of every compressed entry of a package without decompressing them, and print what they are made of
+packages with a lot of literals or short copies are the ones that gain the most from being recompressed, nothing is changed*/
+void analyzePackage(filesystem::path fileName, wstring displayPath) {
+	dbpf::MappedFile file;
+	
+	if(!file.open(fileName)) {
+		wcout << displayPath << L": Failed to open file" << endl;
+		return;
+	}
+	
+	dbpf::Package package = dbpf::getPackage(file, displayPath, dbpf::SKIP);
+	
+	if(!package.unpacked) {
+		return;
+	}
+	
+	uint entries = 0;
+	uint invalid = 0;
+	uint64_t compressedSize = 0;
+	uint64_t uncompressedSize = 0;
+	uint64_t literalBytes = 0;
+	uint64_t shortCopies = 0;
+	uint64_t mediumCopies = 0;
+	uint64_t longCopies = 0;
+	uint64_t overlappingCopies = 0;
+	
+	for(auto& entry: package.entries) {
+		if(!entry.compressed) {
+			continue;
+		}
+		
+		auto content = dbpf::readFile(file, entry.location, entry.size);
+		qfs_stats stats;
+		
+		if(!qfs_analyze(content.data(), content.size(), &stats)) {
+			invalid++;
+			continue;
+		}
+		
+		entries++;
+		compressedSize += stats.compressed_size;
+		uncompressedSize += stats.uncompressed_size;
+		literalBytes += stats.literal_bytes;
+		shortCopies += stats.short_copies;
+		mediumCopies += stats.medium_copies;
+		longCopies += stats.long_copies;
+		overlappingCopies += stats.overlapping_copies;
+	}
+	
+	wcout << displayPath << L": " << entries << L" compressed entries, " << fixed << setprecision(2);
+	wcout << compressedSize / (1024.0 * 1024.0) << L" MB -> " << uncompressedSize / (1024.0 * 1024.0) << L" MB, ";
+	wcout << (uncompressedSize > 0 ? literalBytes * 100.0 / uncompressedSize : 0.0) << L"% literals, ";
+	wcout << shortCopies << L" short, " << mediumCopies << L" medium and " << longCopies << L" long copies, " << overlappingCopies << L" overlapping";
+	
+	if(invalid > 0) {
+		wcout << L", " << invalid << L" invalid";
+	}
+	
+	wcout << endl;
+}
+
+int run(vector<filesystem::path> argv) {
+	int argc = argv.size();
 	
 	if(argc == 1) {
 		wcout << L"No arguments provided" << endl;
@@ -30,21 +438,126 @@ int wmain(int argc, wchar_t *argv[]) {
 	}
 	
 	//parse args
-	wstring arg = argv[1];
+	filesystem::path arg = argv[1];
 	
-	if(arg == L"help") {
+	if(arg == "help") {
 		wcout << L"dbpf-recompress.exe -args package_file_or_folder" << endl;
 		wcout << L"  -d  decompress" << endl;
+		wcout << L"  -k  compact: drop holes and unused space and write a new index, entries are copied as they are without being decompressed" << endl;
+		wcout << L"  -f  favor decompression speed over compression ratio" << endl;
+		wcout << L"  -p  use positional reads and writes instead of memory mapping files" << endl;
+		wcout << L"  -m size  put packages of up to size MB together in memory before writing them (default 32, 0 to turn off)" << endl;
+		wcout << L"  -i size  keep about size MB of entries in memory at once while compressing and validating (default 16)" << endl;
+		wcout << L"  -g gain  keep packages that would get less than gain bytes or gain% smaller as they are (for example -g 4096 or -g 1%)" << endl;
+		#ifdef __linux__
+			wcout << L"  -u  read and write whole packages in the background with io_uring" << endl;
+			wcout << L"  -b  the same as -u but with plain system calls (for comparison)" << endl;
+			wcout << L"  -w  write new files past the system cache with O_DIRECT, for large batches (implies -p)" << endl;
+		#endif
+		wcout << L"  -o key  lay out entries sorted by key, made of t, g, i, and r for type, group, instance, and resource (for example -o gti)" << endl;
+		wcout << L"  -t file  put the entries listed in a trace first, in the order they are listed (one \"type group instance [resource]\" in hex per line)" << endl;
+		wcout << L"  -c file  merge all of the packages into file, if more than one package has a resource then the one with the last path wins" << endl;
+		wcout << L"  -r  read each package in the order of -t or -o (or group by group) without changing it, and print how scattered the reads are" << endl;
+		wcout << L"  -s  print what the compressed entries of each package are made of (literals and copies) without changing it" << endl;
+		wcout << L"  packages that are already compressed are skipped, decompress them first to lay them out again" << endl;
 		wcout << endl;
 		return 0;
 	}
 	
 	dbpf::Mode default_mode = dbpf::RECOMPRESS;
+	bool fastDecode = false;
+	bool positionalIO = false;
+	bool useEngine = false;
+	bool useRing = false;
+	bool direct = false;
+	size_t stagingSize = 32 * 1024 * 1024;
+	size_t budget = dbpf::DEFAULT_BUDGET;
+	MinimumGain minGain;
+	dbpf::Ordering ordering;
+	bool replay = false;
+	bool analyze = false;
+	filesystem::path mergePath;
 	int fileArgIndex = 1;
 	
-	if(arg == L"-d") {
-		default_mode = dbpf::DECOMPRESS;
-		fileArgIndex = 2;
+	//flags come before the file path
+	for(; fileArgIndex < argc && argv[fileArgIndex].native()[0] == '-'; fileArgIndex++) {
+		arg = argv[fileArgIndex];
+		
+		if(arg == "-d") {
+			default_mode = dbpf::DECOMPRESS;
+		} else if(arg == "-k") {
+			default_mode = dbpf::COMPACT;
+		} else if(arg == "-f") {
+			fastDecode = true;
+		} else if(arg == "-p") {
+			positionalIO = true;
+		} else if((arg == "-m" || arg == "-i") && fileArgIndex + 1 < argc) {
+			try {
+				size_t size = stoul(argv[++fileArgIndex].string()) * 1024 * 1024;
+				(arg == "-m" ? stagingSize : budget) = size;
+			}
+			
+			catch(const logic_error&) {
+				wcout << L"Invalid size " << getDisplayName(argv[fileArgIndex]) << endl;
+				return 0;
+			}
+			
+			if(budget == 0) {
+				wcout << L"Invalid size 0" << endl;
+				return 0;
+			}
+		} else if(arg == "-g" && fileArgIndex + 1 < argc) {
+			string gain = argv[++fileArgIndex].string();
+			
+			try {
+				if(!gain.empty() && gain.back() == '%') {
+					minGain.percent = stod(gain.substr(0, gain.size() - 1));
+				} else {
+					minGain.bytes = stoull(gain);
+				}
+			}
+			
+			catch(const logic_error&) {
+				wcout << L"Invalid gain " << getDisplayName(argv[fileArgIndex]) << endl;
+				return 0;
+			}
+		} else if(arg == "-o" && fileArgIndex + 1 < argc) {
+			ordering.key = argv[++fileArgIndex].string();
+			
+			if(!dbpf::isValidOrderingKey(ordering.key)) {
+				wcout << L"Invalid key " << getDisplayName(argv[fileArgIndex]) << endl;
+				return 0;
+			}
+		} else if(arg == "-t" && fileArgIndex + 1 < argc) {
+			if(!readTrace(argv[++fileArgIndex], ordering.trace)) {
+				return 0;
+			}
+		} else if(arg == "-r") {
+			replay = true;
+		} else if(arg == "-s") {
+			analyze = true;
+		} else if(arg == "-c" && fileArgIndex + 1 < argc) {
+			mergePath = argv[++fileArgIndex];
+			
+			if(mergePath.extension() != ".package") {
+				wcout << L"Not a package file " << getDisplayName(mergePath) << endl;
+				return 0;
+			}
+		#ifdef __linux__
+		} else if(arg == "-u") {
+			useEngine = true;
+			useRing = true;
+		} else if(arg == "-b") {
+			useEngine = true;
+			useRing = false;
+		} else if(arg == "-w") {
+			positionalIO = true;
+			direct = true;
+		#endif
+		} else {
+			wcout << L"Unknown argument " << getDisplayName(arg) << endl;
+			return 0;
+		}
 	}
 	
 	if(fileArgIndex > argc - 1) {
@@ -52,7 +565,7 @@ int wmain(int argc, wchar_t *argv[]) {
 		return 0;
 	}
 	
-	wstring pathName = argv[fileArgIndex];
+	filesystem::path pathName = argv[fileArgIndex];
 	
 	auto files = vector<filesystem::directory_entry>();
 	bool is_dir = false;
@@ -79,169 +592,547 @@ int wmain(int argc, wchar_t *argv[]) {
 		return 0;
 	}
 	
+	//packages are merged in the order of their paths, leaving out the merged package if it's there from last time
+	if(!mergePath.empty()) {
+		files.erase(remove_if(files.begin(), files.end(), [&](filesystem::directory_entry& dir_entry) {
+			error_code error;
+			return filesystem::equivalent(dir_entry.path(), mergePath, error);
+		}), files.end());
+		
+		sort(files.begin(), files.end());
+	}
+	
+	//for cout
+	vector<wstring> displayPaths;
+	
+	for(auto& dir_entry: files) {
+		if(is_dir) {
+			displayPaths.push_back(getDisplayName(filesystem::relative(dir_entry.path(), pathName)));
+		} else {
+			displayPaths.push_back(getDisplayName(dir_entry.path()));
+		}
+	}
+	
+	//put back packages that were being changed in place when the program stopped last time
 	for(auto& dir_entry: files) {
-		auto mode = default_mode;
+		recoverFile(dir_entry.path());
+	}
+	
+	if(replay) {
+		for(uint i = 0; i < files.size(); i++) {
+			replayPackage(files[i].path(), displayPaths[i], ordering);
+		}
+		
+		wcout << endl;
+		return 0;
+	}
+	
+	if(analyze) {
+		for(uint i = 0; i < files.size(); i++) {
+			analyzePackage(files[i].path(), displayPaths[i]);
+		}
 		
+		wcout << endl;
+		return 0;
+	}
+	
+	if(!mergePath.empty()) {
+		vector<filesystem::path> paths;
+		
+		for(auto& dir_entry: files) {
+			paths.push_back(dir_entry.path());
+		}
+		
+		if(positionalIO) {
+			mergePackages<dbpf::File>(paths, displayPaths, mergePath, default_mode, fastDecode, budget, ordering);
+		} else {
+			mergePackages<dbpf::MappedFile>(paths, displayPaths, mergePath, default_mode, fastDecode, budget, ordering);
+		}
+		
+		wcout << endl;
+		return 0;
+	}
+	
+	#ifdef __linux__
+		if(useEngine) {
+			processWithEngine(files, displayPaths, default_mode, fastDecode, useRing, budget, minGain, ordering);
+			wcout << endl;
+			return 0;
+		}
+	#endif
+	
+	for(uint i = 0; i < files.size(); i++) {
 		//open file
-		wstring fileName = dir_entry.path().wstring();
-		wstring tempFileName = fileName + L".new";
+		filesystem::path fileName = files[i].path();
+		wstring displayPath = displayPaths[i];
 		
-		float current_size = dir_entry.file_size() / 1024.0;
+		float current_size = files[i].file_size() / 1024.0;
 		
-		wstring displayPath; //for cout
+		//files are memory mapped unless positional I/O is asked for, or if the file can't be mapped
+		bool processed = false;
+		dbpf::MappedFile mappedFile;
 		
-		if(is_dir) {
-			displayPath = filesystem::relative(fileName, pathName).wstring();
+		if(!positionalIO && mappedFile.open(fileName)) {
+			processed = processFile(mappedFile, fileName, displayPath, default_mode, fastDecode, stagingSize, budget, direct, minGain, ordering);
+			
 		} else {
-			displayPath = fileName;
+			dbpf::File file;
+			
+			if(!file.open(fileName)) {
+				wcout << displayPath << L": Failed to open file" << endl;
+				continue;
+			}
+			
+			processed = processFile(file, fileName, displayPath, default_mode, fastDecode, stagingSize, budget, direct, minGain, ordering);
 		}
 		
-		fstream file = fstream(fileName, ios::in | ios::binary);
+		if(!processed) {
+			continue;
+		}
 		
-		if(!file.is_open()) {
-			wcout << displayPath << L": Failed to open file" << endl;
+		float new_size = filesystem::file_size(fileName) / 1024.0;
+		printSizes(displayPath, current_size, new_size);
+	}
+	
+	wcout << endl;
+	return 0;
+}
+
+#ifdef __linux__
+
+/*same as the loop in run() but the packages are read ahead and written behind by the I/O engine
+each package is compressed and validated in memory, the size is printed once the new file is in place*/
+void processWithEngine(vector<filesystem::directory_entry>& files, vector<wstring>& displayPaths, dbpf::Mode mode, bool fastDecode, bool useRing, size_t budget, MinimumGain minGain, const dbpf::Ordering& ordering) {
+	const size_t READ_AHEAD = 256 * 1024 * 1024;
+	dbpf::IoEngine engine(useRing, READ_AHEAD);
+	
+	if(useRing && !engine.is_ring()) {
+		wcout << L"io_uring is not available, using plain system calls" << endl;
+	}
+	
+	vector<filesystem::path> paths;
+	vector<float> current_sizes = vector<float>(files.size());
+	
+	for(auto& dir_entry: files) {
+		paths.push_back(dir_entry.path());
+	}
+	
+	//packages that were compressed before are skipped before they are loaded, only their headers are read
+	vector<filesystem::path> loadPaths;
+	vector<uint> loaded;
+	
+	for(uint i = 0; i < files.size(); i++) {
+		dbpf::File file;
+		
+		if(mode == dbpf::RECOMPRESS && file.open(paths[i])) {
+			dbpf::Package header = dbpf::getPackageHeader(file, displayPaths[i]);
+			
+			if(!header.unpacked) {
+				continue;
+			}
+			
+			if(header.signature_in_package) {
+				float current_size = files[i].file_size() / 1024.0;
+				printSizes(displayPaths[i], current_size, current_size);
+				continue;
+			}
+		}
+		
+		loadPaths.push_back(paths[i]);
+		loaded.push_back(i);
+	}
+	
+	engine.load(loadPaths);
+	
+	size_t id;
+	bool success;
+	
+	for(uint i: loaded) {
+		dbpf::MemoryFile file;
+		
+		if(!engine.next(file)) {
+			wcout << displayPaths[i] << L": Failed to open file" << endl;
 			continue;
 		}
 		
-		//get package
-		dbpf::Package package = dbpf::getPackage(file, displayPath, mode);
-		dbpf::Package oldPackage = package; //copy
+		float current_size = file.size() / 1024.0;
+		dbpf::MemoryFile tempFile;
+		dbpf::Package package = readPackage(file, displayPaths[i], mode);
 		
-		//optimization: if the package file has the compressor's signature then skip it
-		if(mode == dbpf::RECOMPRESS && package.signature_in_package) {
-			mode = dbpf::SKIP;
-			file.close();
+		if(processPackage(file, tempFile, package, paths[i], displayPaths[i], mode, fastDecode, budget, false, minGain, ordering)) {
+			//skipped packages are left as they are, packages that only got the signature were changed in place
+			if(!tempFile.is_open()) {
+				printSizes(displayPaths[i], current_size, filesystem::file_size(paths[i]) / 1024.0);
+			} else {
+				current_sizes[i] = current_size;
+				filesystem::path tempFileName = paths[i];
+				tempFileName += ".new";
+				engine.store(i, tempFileName, paths[i], tempFile.release());
+			}
 		}
 		
-		//error unpacking package, getPackage already prints an error so there is no need to print one here
-		if(!package.unpacked) {
-			file.close();
+		//report the writes that are done so far
+		while(engine.stored(id, success, false)) {
+			if(success) {
+				printSizes(displayPaths[id], current_sizes[id], filesystem::file_size(paths[id]) / 1024.0);
+			} else {
+				wcout << displayPaths[id] << L": Failed to overwrite file" << endl;
+			}
+		}
+	}
+	
+	while(engine.stored(id, success, true)) {
+		if(success) {
+			printSizes(displayPaths[id], current_sizes[id], filesystem::file_size(paths[id]) / 1024.0);
+		} else {
+			wcout << displayPaths[id] << L": Failed to overwrite file" << endl;
+		}
+	}
+}
+
+#endif
+
+/*put all of the packages together into one package at outputPath, the packages themselves are left as they are
+the packages are read in parallel and merged in the order of their paths, if more than one package has a resource then the last one wins
+the merged package goes through putPackage and validatePackage like any other package, with all of the packages read as one old file
+so every entry in the new package is checked against the package it came from*/
+template<class FileType>
+bool mergePackages(vector<filesystem::path>& paths, vector<wstring>& displayPaths, filesystem::path outputPath, dbpf::Mode mode, bool fastDecode, size_t budget, const dbpf::Ordering& ordering) {
+	wstring outputDisplayPath = getDisplayName(outputPath);
+	uint count = paths.size();
+	
+	if(count == 0) {
+		wcout << L"No packages to merge" << endl;
+		return false;
+	}
+	
+	dbpf::MergedFile<FileType> mergedFile(count);
+	vector<dbpf::Package> packages = vector<dbpf::Package>(count);
+	bool success = true;
+	
+	#pragma omp parallel for reduction(&&:success)
+	for(int i = 0; i < (int) count; i++) {
+		if(!mergedFile.getFile(i).open(paths[i])) {
+			wcout << displayPaths[i] << L": Failed to open file" << endl;
+			success = false;
 			continue;
 		}
 		
-		//optimization: for DECOMPRESS mode skip the package file if all of it's entries are decompressed
-		if(mode == dbpf::DECOMPRESS) {
-			bool all_entries_decompressed = true;
+		//getPackage already prints an error
+		packages[i] = dbpf::getPackage(mergedFile.getFile(i), displayPaths[i], mode);
+		success = success && packages[i].unpacked;
+	}
+	
+	if(!success) {
+		wcout << outputDisplayPath << L": Packages were not merged" << endl;
+		return false;
+	}
+	
+	//the merged package gets the header of the first package with the newest index version, so that no resource numbers are lost
+	//that package goes first in the merged file since the new header is checked against the header at the start of the old file
+	uint first = 0;
+	
+	for(uint i = 1; i < count; i++) {
+		if(packages[i].header.indexMinorVersion > packages[first].header.indexMinorVersion) {
+			first = i;
+		}
+	}
+	
+	vector<size_t> placeOrder = {first};
+	size_t entryCount = 0;
+	double oldSize = 0;
+	
+	for(uint i = 0; i < count; i++) {
+		if(i != first) {
+			placeOrder.push_back(i);
+		}
+		
+		entryCount += packages[i].entries.size();
+		oldSize += mergedFile.getFile(i).size();
+	}
+	
+	mergedFile.place(placeOrder, dbpf::READ_GAP_SIZE + 1);
+	
+	if(mergedFile.size() > UINT32_MAX) {
+		wcout << outputDisplayPath << L": Packages are too large to merge" << endl;
+		return false;
+	}
+	
+	//resources that are in more than one package are taken from the last one, going backwards the first package to have a resource is the last one
+	dbpf::TgirMap owners;
+	owners.reserve(entryCount);
+	
+	for(uint i = count; i-- > 0;) {
+		for(auto& entry: packages[i].entries) {
+			owners.insert(dbpf::getTgir(entry), i);
+		}
+	}
+	
+	dbpf::Package package;
+	package.header = packages[first].header;
+	package.entries.reserve(entryCount);
+	uint replaced = 0;
+	
+	for(uint i = 0; i < count; i++) {
+		for(auto& entry: packages[i].entries) {
+			if(*owners.find(dbpf::getTgir(entry)) != i) {
+				replaced++;
+				continue;
+			}
 			
-			for(auto& entry: package.entries) {
-				if(entry.compressed) {
-					all_entries_decompressed = false;
+			dbpf::Entry mergedEntry = entry;
+			mergedEntry.location += mergedFile.getOffset(i);
+			package.entries.push_back(mergedEntry);
+		}
+	}
+	
+	packages = vector<dbpf::Package>();
+	
+	//compress entries, pack package, and write to temp file
+	filesystem::path tempFileName = outputPath;
+	tempFileName += ".new";
+	
+	FileType tempFile;
+	dbpf::PackageLayout layout;
+	
+	if(dbpf::createFile(tempFile, tempFileName, dbpf::getMaxPackageSize(mergedFile, package, mode, budget))) {
+		layout = dbpf::putPackage(tempFile, mergedFile, package, mode, fastDecode, budget, ordering);
+		
+	} else {
+		wcout << outputDisplayPath << L": Failed to create temp file" << endl;
+		return false;
+	}
+	
+	//validate new file
+	bool is_valid = validatePackage(package, layout, mergedFile, tempFile, outputDisplayPath, mode, budget);
+	
+	mergedFile.close();
+	
+	if(!is_valid) {
+		tempFile.close();
+		tryDelete(tempFileName);
+		return false;
+	}
+	
+	if(!replaceFile(tempFile, tempFileName, outputPath)) {
+		wcout << outputDisplayPath << L": Failed to write file" << endl;
+		return false;
+	}
+	
+	wcout << outputDisplayPath << L": " << count << L" packages merged, " << package.entries.size() << L" entries, " << replaced << L" replaced by later packages" << endl;
+	printSizes(outputDisplayPath, oldSize / 1024.0, filesystem::file_size(outputPath) / 1024.0);
+	return true;
+}
+
+//get the package for processPackage, the header and the holes are read first, this catches files that are not Sims 2 packages before the index is read
+//optimization: if the package file has the compressor's signature then it's skipped when recompressing, so its index isn't read at all
+//unpacked is false if the package could not be read, getPackageHeader and getPackageEntries already print an error
+template<class FileType>
+dbpf::Package readPackage(FileType& file, wstring displayPath, dbpf::Mode mode) {
+	dbpf::Package package = dbpf::getPackageHeader(file, displayPath);
+	
+	if(package.unpacked && !(package.signature_in_package && mode == dbpf::RECOMPRESS) && !dbpf::getPackageEntries(file, displayPath, package, mode)) {
+		package.unpacked = false;
+	}
+	
+	return package;
+}
+
+//compress or decompress one package and replace the old file with the new one
+//package is the package as read by readPackage, tempFile is used for the new package, it's left closed if the package was skipped
+//returns false if the package could not be processed, the error is printed here
+template<class FileType, class TempFileType>
+bool processPackage(FileType& file, TempFileType& tempFile, dbpf::Package& package, filesystem::path fileName, wstring displayPath, dbpf::Mode mode, bool fastDecode, size_t budget, bool direct, MinimumGain minGain, const dbpf::Ordering& ordering) {
+	filesystem::path tempFileName = fileName;
+	tempFileName += ".new";
+	
+	//the package file has the compressor's signature
+	if(package.unpacked && package.signature_in_package && mode == dbpf::RECOMPRESS) {
+		file.close();
+		return true;
+	}
+	
+	//error unpacking package
+	if(!package.unpacked) {
+		file.close();
+		return false;
+	}
+	
+	//optimization: for DECOMPRESS mode skip the package file if all of it's entries are decompressed, unless they are going to be laid out differently
+	if(mode == dbpf::DECOMPRESS) {
+		bool all_entries_decompressed = true;
+		
+		for(auto& entry: package.entries) {
+			if(entry.compressed) {
+				all_entries_decompressed = false;
+				break;
+			}
+		}
+		
+		if(all_entries_decompressed && dbpf::getWriteOrder(package.entries, ordering) == dbpf::getFileOrder(package.entries)) {
+			mode = dbpf::SKIP;
+			file.close();
+		}
+	}
+	
+	//optimization: for COMPACT mode skip the package file if there is nothing to drop from it and the entries stay in the same order
+	if(mode == dbpf::COMPACT && dbpf::getCompactSize(package) >= dbpf::getFileSize(file) && dbpf::getWriteOrder(package.entries, ordering) == dbpf::getFileOrder(package.entries)) {
+		mode = dbpf::SKIP;
+		file.close();
+	}
+	
+	if(mode != dbpf::SKIP) {
+		//every entry is going to be read, start reading the file in ahead of time
+		file.advise(dbpf::WILL_NEED);
+		
+		//compress entries, pack package, and write to temp file
+		//the package stays as it was read, where everything went in the new file is in the layout
+		dbpf::PackageLayout layout;
+		
+		//optimization: if no entry got any smaller, or the package didn't get smaller by minGain, then the old file is kept and the signature is added to it in place
+		//this is decided once every entry is compressed, before the new package is written, the entries in the old file stay as they are so only the compression info has to be checked
+		auto keep = [&](dbpf::PackageLayout& layout) {
+			if(mode != dbpf::RECOMPRESS) {
+				return true;
+			}
+			
+			bool changed = layout.shared > 0 || layout.reordered;
+			
+			for(uint i = 0; i < package.entries.size(); i++) {
+				if(layout.entries[i].size != package.entries[i].size) {
+					changed = true;
 					break;
 				}
 			}
 			
-			if(all_entries_decompressed) {
-				mode = dbpf::SKIP;
-				file.close();
-			}
-		}
+			double oldSize = dbpf::getFileSize(file);
+			double gain = oldSize - layout.size;
+			bool enough = changed && gain >= minGain.bytes && gain >= oldSize * minGain.percent / 100;
+			
+			return enough || !dbpf::checkCompressionInfo(file, package, budget);
+		};
 		
-		if(mode != dbpf::SKIP) {
-			//compress entries, pack package, and write to temp file
-			fstream tempFile = fstream(tempFileName, ios::in | ios::out | ios::binary | ios::trunc);
+		//the temp file is only created once the package is known to be replaced, unless the package is too large to hold back until then
+		bool created = true;
+		
+		auto create = [&]() {
+			created = dbpf::createFile(tempFile, tempFileName, dbpf::getMaxPackageSize(file, package, mode, budget), direct);
 			
-			if(tempFile.is_open()) {
-				dbpf::putPackage(tempFile, file, package, mode);
-				
-			} else {
+			if(!created) {
 				wcout << displayPath << L": Failed to create temp file" << endl;
-				file.close();
-				continue;
 			}
 			
-			//validate new file
-			tempFile.seekg(0, ios::beg);
-			dbpf::Package newPackage = dbpf::getPackage(tempFile, tempFileName, mode);
-			bool is_valid = validatePackage(oldPackage, newPackage, file, tempFile, displayPath, mode);
-			
+			return created;
+		};
+		
+		layout = dbpf::putPackage(tempFile, file, package, mode, fastDecode, budget, ordering, create, keep);
+		
+		if(!created) {
+			file.close();
+			return false;
+		}
+		
+		if(!layout.written) {
+			uint fileSize = dbpf::getFileSize(file);
 			file.close();
-			tempFile.close();
 			
-			if(!is_valid) {
+			if(tempFile.is_open()) {
+				tempFile.close();
 				tryDelete(tempFileName);
-				continue;
 			}
 			
-			float new_size = filesystem::file_size(tempFileName) / 1024.0;
-			
-			//overwrite old file
-			try {
-				filesystem::rename(tempFileName, fileName);
+			if(!stampFile(fileName, fileSize)) {
+				wcout << displayPath << L": Failed to add the signature to the file" << endl;
+				return false;
 			}
 			
-			catch(filesystem::filesystem_error) {
-				wcout << displayPath << L": Failed to overwrite file" << endl;
-				tryDelete(tempFileName);
-				continue;
-			}
+			return true;
 		}
 		
-		float new_size = filesystem::file_size(fileName) / 1024.0;
+		//validate new file
+		bool is_valid = validatePackage(package, layout, file, tempFile, displayPath, mode, budget);
 		
-		//output file size to console
-		wcout << displayPath << L" " << fixed << setprecision(2);
+		file.close();
 		
-		if(current_size >= 1000) {
-			wcout << current_size / 1024.0 << L" MB";
-		} else {
-			wcout << current_size << L" KB";
+		if(!is_valid) {
+			tempFile.close();
+			tryDelete(tempFileName);
+			return false;
 		}
 		
-		wcout << " -> ";
-		
-		if(new_size >= 1000) {
-			wcout << new_size / 1024.0 << L" MB";
-		} else {
-			wcout << new_size << L" KB";
+		//overwrite old file
+		if(!replaceFile(tempFile, tempFileName, fileName)) {
+			wcout << displayPath << L": Failed to overwrite file" << endl;
+			return false;
 		}
-		
-		wcout << endl;
 	}
 	
-	wcout << endl;
-	return 0;
+	return true;
 }
 
 //checks if the new package file is valid
-bool validatePackage(dbpf::Package& oldPackage, dbpf::Package& newPackage, fstream& oldFile, fstream& newFile, wstring displayPath, dbpf::Mode mode) {
-	//package unpacking failed, getPackage already prints an error
-	if(!newPackage.unpacked) {
+template<class FileType, class TempFileType>
+bool validatePackage(dbpf::Package& package, dbpf::PackageLayout& layout, FileType& oldFile, TempFileType& newFile, wstring displayPath, dbpf::Mode mode, size_t budget) {
+	//compare headers
+	auto oldHeader = dbpf::readFile(oldFile, 0, 96);
+	auto newHeader = dbpf::readFile(newFile, 0, 96);
+	
+	if(!equal(oldHeader.begin(), oldHeader.begin() + 36, newHeader.begin())
+	|| !equal(oldHeader.begin() + 60, oldHeader.end(), newHeader.begin() + 60)) {
+		wcout << displayPath << L": New header does not match the old header" << endl;
 		return false;
 	}
 	
-	//compare headers
-	bytes oldHeader = dbpf::readFile(oldFile, 0, 96);
-	bytes newHeader = dbpf::readFile(newFile, 0, 96);
+	//the index and hole info in the new header should be what was written
+	uint pos = 36;
+	uint indexEntryCount = dbpf::getInt(newHeader, pos);
+	uint indexLocation = dbpf::getInt(newHeader, pos);
+	uint indexSize = dbpf::getInt(newHeader, pos);
+	uint holeIndexEntryCount = dbpf::getInt(newHeader, pos);
+	uint holeIndexLocation = dbpf::getInt(newHeader, pos);
+	uint holeIndexSize = dbpf::getInt(newHeader, pos);
 	
-	if(bytes(oldHeader.begin(), oldHeader.begin() + 36) != bytes(newHeader.begin(), newHeader.begin() + 36)
-	|| bytes(oldHeader.begin() + 60, oldHeader.end()) != bytes(newHeader.begin() + 60, newHeader.end())) {
-		wcout << displayPath << L": New header does not match the old header" << endl;
+	if(indexEntryCount != layout.header.indexEntryCount || indexLocation != layout.header.indexLocation || indexSize != layout.header.indexSize
+	|| holeIndexEntryCount != layout.header.holeIndexEntryCount || holeIndexLocation != layout.header.holeIndexLocation || holeIndexSize != layout.header.holeIndexSize) {
+		wcout << displayPath << L": Index information in the header does not match what was written" << endl;
+		return false;
+	}
+	
+	uint fileSize = dbpf::getFileSize(newFile);
+	
+	if(fileSize != layout.size) {
+		wcout << displayPath << L": File size does not match what was written" << endl;
 		return false;
 	}
 	
-	if(mode == dbpf::RECOMPRESS) {
+	if(dbpf::putsSignature(package, mode)) {
 		//should only have one hole for the compressor signature
-		if(newPackage.header.holeIndexEntryCount != 1) {
+		if(holeIndexEntryCount != 1) {
 			wcout << displayPath << L": Wrong hole index count" << endl;
 			return false;
 		}
 		
 		//one hole index entry is 8 bytes long
-		if(newPackage.header.holeIndexSize != 8) {
+		if(holeIndexSize != 8 || (size_t) holeIndexLocation + holeIndexSize > fileSize) {
 			wcout << displayPath << L": Wrong hole index size" << endl;
 			return false;
 		}
 		
-		dbpf::Hole hole = newPackage.holes[0];
+		auto holeIndex = dbpf::readFile(newFile, holeIndexLocation, 8);
+		pos = 0;
+		
+		dbpf::Hole hole;
+		hole.location = dbpf::getInt(holeIndex, pos);
+		hole.size = dbpf::getInt(holeIndex, pos);
 		
 		//compressor signature is 8 bytes long
-		if(hole.size != 8) {
-			wcout << L": Wrong hole size" << endl;
+		if(hole.size != 8 || (size_t) hole.location + hole.size > fileSize) {
+			wcout << displayPath << L": Wrong hole size" << endl;
 			return false;
 		}
 		
-		bytes holeData = dbpf::readFile(newFile, hole.location, 8);
-		uint pos = 0;
+		auto holeData = dbpf::readFile(newFile, hole.location, 8);
+		pos = 0;
 		
 		uint sig = dbpf::getInt(holeData, pos);
 		
@@ -252,7 +1143,6 @@ bool validatePackage(dbpf::Package& oldPackage, dbpf::Package& newPackage, fstre
 		}
 		
 		uint fileSizeInHole = dbpf::getInt(holeData, pos);
-		uint fileSize = dbpf::getFileSize(newFile);
 		
 		//file size written in the hole should match the actual file size
 		if(fileSizeInHole != fileSize) {
@@ -261,34 +1151,148 @@ bool validatePackage(dbpf::Package& oldPackage, dbpf::Package& newPackage, fstre
 		}
 	}
 	
-	//should have the exact number of entries as the original package
-	//NOTE: getPackage does not include the directory of compressed files entry in the entries vector for both packages
-	if(oldPackage.entries.size() != newPackage.entries.size()) {
+	//should have the exact number of entries as the original package, plus the directory of compressed files if there is one
+	uint fieldCount = package.header.indexMinorVersion == 2 ? 6 : 5;
+	bool hasClst = layout.clstSize > 0;
+	
+	if(package.entries.size() != layout.entries.size() || indexEntryCount != package.entries.size() + (hasClst ? 1 : 0)) {
 		wcout << displayPath << L": Number of entries between old package and new package not matching" << endl;
 		return false;
 	}
 	
-	//compare entries
-	for(uint i = 0; i < oldPackage.entries.size(); i++) {
-		auto& oldEntry = oldPackage.entries[i];
-		auto& newEntry = newPackage.entries[i];
+	if((size_t) indexEntryCount * fieldCount * 4 != indexSize || (size_t) indexLocation + indexSize > fileSize) {
+		wcout << displayPath << L": Wrong index size" << endl;
+		return false;
+	}
+	
+	//the index in the new file should list the entries of the old package in the same order, at the places they were written to
+	//it's read straight into integers and checked against the layout instead of being unpacked into a second package
+	auto indexData = dbpf::readFile(newFile, indexLocation, indexSize);
+	vector<uint> index(indexEntryCount * fieldCount);
+	dbpf::getInts(indexData, 0, index.data(), index.size());
+	
+	for(uint i = 0; i < indexEntryCount; i++) {
+		uint* fields = &index[i * fieldCount];
+		uint resource = fieldCount == 6 ? fields[3] : 0;
+		uint location = fields[fieldCount - 2];
+		uint size = fields[fieldCount - 1];
+		
+		bool tgirMatches;
+		bool placeMatches;
+		
+		if(i < package.entries.size()) {
+			auto& entry = package.entries[i];
+			tgirMatches = fields[0] == entry.type && fields[1] == entry.group && fields[2] == entry.instance && resource == entry.resource;
+			placeMatches = location == layout.entries[i].location && size == layout.entries[i].size;
+		} else {
+			tgirMatches = fields[0] == dbpf::CLST_TYPE && fields[1] == dbpf::CLST_GROUP && fields[2] == dbpf::CLST_INSTANCE && resource == 0;
+			placeMatches = location == layout.clstLocation && size == layout.clstSize;
+		}
 		
-		//compare TGIRs
-		if(oldEntry.type != newEntry.type || oldEntry.group != newEntry.group || oldEntry.instance != newEntry.instance || oldEntry.resource != newEntry.resource) {
+		if(!tgirMatches) {
 			wcout << displayPath << L": Types, groups, instances, or resources of entries not matching" << endl;
 			return false;
 		}
 		
+		if(!placeMatches || (size_t) location + size > fileSize) {
+			wcout << displayPath << L": Entry location or size in the index does not match what was written" << endl;
+			return false;
+		}
+	}
+	
+	//entries can share their content with other entries, but otherwise they should not overlap with each other or with what comes after them
+	vector<uint> order(layout.entries.size());
+	
+	for(uint i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	
+	sort(order.begin(), order.end(), [&](uint a, uint b) {
+		auto& entryA = layout.entries[a];
+		auto& entryB = layout.entries[b];
+		return entryA.location < entryB.location || (entryA.location == entryB.location && entryA.size < entryB.size);
+	});
+	
+	uint entriesEnd = 96;
+	
+	for(uint k = 0; k < order.size(); k++) {
+		auto& entry = layout.entries[order[k]];
+		
+		if(k > 0) {
+			auto& previous = layout.entries[order[k - 1]];
+			
+			if(entry.location == previous.location && entry.size == previous.size && entry.compressed == previous.compressed) {
+				continue;
+			}
+		}
+		
+		if(entry.size > 0 && entry.location < entriesEnd) {
+			wcout << displayPath << L": Entries overlap in the new package" << endl;
+			return false;
+		}
+		
+		entriesEnd = max(entriesEnd, entry.location + entry.size);
+	}
+	
+	if(entriesEnd > (hasClst ? layout.clstLocation : indexLocation)) {
+		wcout << displayPath << L": Entries overlap in the new package" << endl;
+		return false;
+	}
+	
+	//the directory of compressed files should list exactly the compressed entries, in index order
+	if(hasClst) {
+		uint clstFieldCount = fieldCount - 1;
+		auto clstData = dbpf::readFile(newFile, layout.clstLocation, layout.clstSize);
+		vector<uint> clst(layout.clstSize / 4);
+		dbpf::getInts(clstData, 0, clst.data(), clst.size());
+		uint next = 0;
+		
+		for(uint i = 0; i < package.entries.size(); i++) {
+			if(!layout.entries[i].compressed) {
+				continue;
+			}
+			
+			auto& entry = package.entries[i];
+			
+			if(next + clstFieldCount > clst.size()) {
+				wcout << displayPath << L": Incorrect compression information" << endl;
+				return false;
+			}
+			
+			uint* fields = &clst[next];
+			uint resource = clstFieldCount == 5 ? fields[3] : 0;
+			next += clstFieldCount;
+			
+			if(fields[0] != entry.type || fields[1] != entry.group || fields[2] != entry.instance || resource != entry.resource
+			|| fields[clstFieldCount - 1] != layout.entries[i].uncompressedSize) {
+				wcout << displayPath << L": Incorrect compression information" << endl;
+				return false;
+			}
+		}
+		
+		if(next * 4 != layout.clstSize) {
+			wcout << displayPath << L": Incorrect compression information" << endl;
+			return false;
+		}
+	}
+	
+	//compare entries, going through them in the order they are in the old file (which is also the order they were written in)
+	//so that both files are read from start to end
+	size_t checkedBytes = 0;
+	
+	for(uint i: dbpf::getFileOrder(package.entries)) {
+		auto& oldEntry = package.entries[i];
+		auto& newEntry = layout.entries[i];
+		
 		//check entry content
-		bytes oldContent = dbpf::readFile(oldFile, oldEntry.location, oldEntry.size);
-		bytes newContent = dbpf::readFile(newFile, newEntry.location, newEntry.size);
+		auto oldData = dbpf::readFile(oldFile, oldEntry.location, oldEntry.size);
+		auto newData = dbpf::readFile(newFile, newEntry.location, newEntry.size);
+		dbpf::Span oldContent = oldData;
+		dbpf::Span newContent = newData;
 		
 		//compression info in the directory of compressed files should match the information in the compression header
 		bool compressed_in_header = newContent.size() >= 9 && newContent[4] == 0x10 && newContent[5] == 0xFB;
-		auto iter = newPackage.compressedEntries.find(dbpf::CompressedEntry{newEntry.type, newEntry.group, newEntry.instance, newEntry.resource});
-		bool in_clst = iter != newPackage.compressedEntries.end();
-		
-		if(compressed_in_header != in_clst) {
+		if(compressed_in_header != newEntry.compressed) {
 			wcout << displayPath << L": Incorrect compression information" << endl;
 			return false;
 		}
@@ -298,7 +1302,7 @@ bool validatePackage(dbpf::Package& oldPackage, dbpf::Package& newPackage, fstre
 			uint uncompressedSize = dbpf::getUncompressedSize(newContent);
 			uint compressedSize = dbpf::getInt(newContent, tempPos);
 			
-			if(uncompressedSize != iter->uncompressedSize) {
+			if(uncompressedSize != newEntry.uncompressedSize) {
 				wcout << displayPath << L": Mismatch between the uncompressed size in the compression header and the uncompressed size in the CLST" << endl;
 				return false;
 			}
@@ -315,14 +1319,36 @@ bool validatePackage(dbpf::Package& oldPackage, dbpf::Package& newPackage, fstre
 			}
 		}
 		
-		//decompress the entries and compare them
-		oldContent = dbpf::decompressEntry(oldEntry, oldContent);
-		newContent = dbpf::decompressEntry(newEntry, newContent);
+		//decompress the entries and compare them, entries that are not compressed are compared as they are
+		//decompressing marks an entry as decompressed, so it's done on copies to leave the package as it is
+		//compacting copies entries as they are, so they are compared as they are without decompressing them
+		bytes oldDecompressed;
+		bytes newDecompressed;
+		dbpf::Entry entry = oldEntry;
+		
+		if(mode != dbpf::COMPACT && dbpf::decompressEntry(entry, oldContent, oldDecompressed)) {
+			oldContent = dbpf::Span(oldDecompressed);
+		}
+		
+		entry.compressed = newEntry.compressed;
+		
+		if(mode != dbpf::COMPACT && dbpf::decompressEntry(entry, newContent, newDecompressed)) {
+			newContent = dbpf::Span(newDecompressed);
+		}
 		
-		if(oldContent != newContent) {
+		if(!equal(oldContent.begin(), oldContent.end(), newContent.begin(), newContent.end())) {
 			wcout << displayPath << L": Mismatch between old entry and new entry" << endl;
 			return false;
 		}
+		
+		//let go of the pages of mapped files every so often so that memory use doesn't grow with the size of the package
+		checkedBytes += oldEntry.size + newEntry.size;
+		
+		if(checkedBytes > budget) {
+			oldFile.advise(dbpf::RELEASE);
+			newFile.advise(dbpf::RELEASE);
+			checkedBytes = 0;
+		}
 	}
 	
 	//if all passes then return true
@@ -1,14 +1,21 @@
 #ifndef DBPF_H
 #define DBPF_H
 
+#include "file.h"
 #include "qfs.h"
 #include "omp.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
-#include <unordered_map>
-#include <unordered_set>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
@@ -35,14 +42,175 @@ namespace dbpf {
 		return buf;
 	}
 
+	//read size bytes from file at pos into buf at bufPos
+	void readFile(fstream& file, uint pos, uint size, bytes& buf, uint bufPos) {
+		file.seekg(pos, ios::beg);
+		file.read(reinterpret_cast<char*>(buf.data() + bufPos), size);
+	}
+
 	void writeFile(fstream& file, bytes& buf) {
 		file.write(reinterpret_cast<char*>(buf.data()), buf.size());
 	}
+	
+	//view of bytes owned by something else, such as a mapped file
+	struct Span {
+		const unsigned char* ptr = nullptr;
+		size_t length = 0;
+		
+		Span() {}
+		Span(const unsigned char* ptr, size_t length): ptr(ptr), length(length) {}
+		Span(const bytes& buf): ptr(buf.data()), length(buf.size()) {}
+		
+		const unsigned char* data() const { return ptr; }
+		size_t size() const { return length; }
+		const unsigned char* begin() const { return ptr; }
+		const unsigned char* end() const { return ptr + length; }
+		const unsigned char& operator[](size_t i) const { return ptr[i]; }
+	};
+	
+	//the same functions for mapped files, reading from a mapped file doesn't copy anything
+	uint getFileSize(MappedFile& file) {
+		return file.size();
+	}
+	
+	Span readFile(MappedFile& file, uint pos, uint size) {
+		return Span(file.data() + pos, size);
+	}
+	
+	void readFile(MappedFile& file, uint pos, uint size, bytes& buf, uint bufPos) {
+		memcpy(buf.data() + bufPos, file.data() + pos, size);
+	}
+	
+	//write buf to file at pos, the file has to be large enough
+	void writeFile(MappedFile& file, uint pos, Span buf) {
+		memcpy(file.data() + pos, buf.data(), buf.size());
+	}
+	
+	//where to write to the file at pos directly, or null if the file has to be written to with writeFile
+	unsigned char* getWritePointer(MappedFile& file, uint pos) {
+		return file.data() + pos;
+	}
+	
+	//the same functions for positional reads and writes, these don't need a lock when used from several threads
+	uint getFileSize(File& file) {
+		return file.size();
+	}
+	
+	bytes readFile(File& file, uint pos, uint size) {
+		bytes buf = bytes(size);
+		file.read(pos, size, buf.data());
+		return buf;
+	}
+	
+	void readFile(File& file, uint pos, uint size, bytes& buf, uint bufPos) {
+		file.read(pos, size, buf.data() + bufPos);
+	}
+	
+	void writeFile(File& file, uint pos, Span buf) {
+		file.write(pos, buf.size(), buf.data());
+	}
+	
+	unsigned char* getWritePointer(File&, uint) {
+		return nullptr;
+	}
+	
+	//create a new file of size bytes, only positional files can be direct
+	template<class FileType>
+	bool createFile(FileType& file, filesystem::path path, size_t size, bool = false) {
+		return file.create(path, size);
+	}
+	
+	bool createFile(File& file, filesystem::path path, size_t size, bool direct = false) {
+		return file.create(path, size, direct);
+	}
+	
+	//copy size bytes from oldFile at oldPos to newFile at pos
+	template<class NewFileType, class FileType>
+	void copyFile(NewFileType& newFile, uint pos, FileType& oldFile, uint oldPos, uint size) {
+		auto content = readFile(oldFile, oldPos, size);
+		writeFile(newFile, pos, content);
+	}
+	
+	//between two files on disk the copy is done by the kernel where possible
+	void copyFile(File& newFile, uint pos, File& oldFile, uint oldPos, uint size) {
+		if(!newFile.copy(pos, oldFile, oldPos, size)) {
+			auto content = readFile(oldFile, oldPos, size);
+			writeFile(newFile, pos, content);
+		}
+	}
+	
+	//whether copyFile can copy without reading the content, in which case entries that stay the same don't need to be read at all
+	template<class NewFileType, class FileType>
+	bool canCopyFile(NewFileType&, FileType&) {
+		return false;
+	}
+	
+	bool canCopyFile(File&, File&) {
+		#ifdef __linux__
+			return true;
+		#else
+			return false;
+		#endif
+	}
+	
+	//the same functions for files held in memory
+	uint getFileSize(MemoryFile& file) {
+		return file.size();
+	}
+	
+	Span readFile(MemoryFile& file, uint pos, uint size) {
+		return Span(file.data() + pos, size);
+	}
+	
+	void readFile(MemoryFile& file, uint pos, uint size, bytes& buf, uint bufPos) {
+		memcpy(buf.data() + bufPos, file.data() + pos, size);
+	}
+	
+	void writeFile(MemoryFile& file, uint pos, Span buf) {
+		memcpy(file.data() + pos, buf.data(), buf.size());
+	}
+	
+	unsigned char* getWritePointer(MemoryFile& file, uint pos) {
+		return file.data() + pos;
+	}
+	
+	//the same functions for merged files, reads are passed on to the file that pos is in, they can't go past the end of it
+	template<class FileType>
+	uint getFileSize(MergedFile<FileType>& file) {
+		return file.size();
+	}
+	
+	template<class FileType>
+	auto readFile(MergedFile<FileType>& file, uint pos, uint size) {
+		size_t i = file.find(pos);
+		return readFile(file.getFile(i), pos - file.getOffset(i), size);
+	}
+	
+	template<class FileType>
+	void readFile(MergedFile<FileType>& file, uint pos, uint size, bytes& buf, uint bufPos) {
+		size_t i = file.find(pos);
+		readFile(file.getFile(i), pos - file.getOffset(i), size, buf, bufPos);
+	}
 
 	//convert 4 bytes from buf at pos to an integer and increment pos (little endian)
-	uint getInt(bytes& buf, uint& pos) {
+	template<class Buffer>
+	uint getInt(const Buffer& buf, uint& pos) {
 		return ((uint) buf[pos++]) + ((uint) buf[pos++] << 8) + ((uint) buf[pos++] << 16) + ((uint) buf[pos++] << 24);
 	}
+	
+	//convert count integers from buf at pos to dst at once (little endian), a plain copy on little endian machines
+	template<class Buffer>
+	void getInts(const Buffer& buf, uint pos, uint* dst, size_t count) {
+		#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			for(size_t i = 0; i < count; i++) {
+				dst[i] = getInt(buf, pos);
+			}
+		#else
+			if(count > 0) {
+				memcpy(dst, buf.data() + pos, count * 4);
+			}
+		#endif
+	}
 
 	//put integer in buf at pos and increment pos (little endian)
 	void putInt(bytes& buf, uint& pos, uint n) {
@@ -52,18 +220,20 @@ namespace dbpf {
 		buf[pos++] = n >> 24;
 	}
 
-	//get the uncompressed size from the compression header (3 bytes big endian integer)
-	uint getUncompressedSize(bytes& buf) {
-		return ((uint) buf[6] << 16) + ((uint) buf[7] << 8) + ((uint) buf[8]);
+	//get the uncompressed size from the compression header at pos (3 bytes big endian integer)
+	template<class Buffer>
+	uint getUncompressedSize(const Buffer& buf, uint pos = 0) {
+		return ((uint) buf[pos + 6] << 16) + ((uint) buf[pos + 7] << 8) + ((uint) buf[pos + 8]);
 	}
 	
 	/* compression mode
 	RECOMPRESS: decompress the package's entries then compress them again, can result in better compression if the older compression is weak
 	DECOMPRESS: decompress the package
 	SKIP: don't do anything with the package
+	COMPACT: copy the entries as they are and drop everything else (holes, old copies of the index, unused bytes), nothing is decompressed
 	*/
 	
-	enum Mode { RECOMPRESS, DECOMPRESS, SKIP };
+	enum Mode { RECOMPRESS, DECOMPRESS, SKIP, COMPACT };
 	
 	//representing the header of a package file
 	struct Header {
@@ -103,29 +273,150 @@ namespace dbpf {
 		uint location;
 		uint size;
 	};
+	
+	//where and how an entry was written to a new package
+	struct EntryLayout {
+		uint location;
+		uint size;
+		uint uncompressedSize;
+		bool compressed;
+	};
 
-	//for holding info from the DIR/CLST
-	struct CompressedEntry {
+	//type, group, instance, and resource, which together tell entries apart
+	struct Tgir {
 		uint type;
 		uint group;
 		uint instance;
 		uint resource;
-		uint uncompressedSize;
-	};
-
-	//for use by sets and maps
-	struct hashFunction {
-		template<class EntryType>
-		size_t operator()(const EntryType& entry) const {
-			return entry.type ^ entry.group ^ entry.instance ^ entry.resource;
+		
+		bool operator==(const Tgir& other) const {
+			return type == other.type && group == other.group && instance == other.instance && resource == other.resource;
 		}
 	};
-
-	struct equalFunction {
-		template<class EntryType>
-		bool operator()(const EntryType& entry, const EntryType& entry2) const {
-			return entry.type == entry2.type && entry.group == entry2.group && entry.instance == entry2.instance && entry.resource == entry2.resource;
+	
+	Tgir getTgir(const Entry& entry) {
+		return Tgir{entry.type, entry.group, entry.instance, entry.resource};
+	}
+	
+	//the finalizer of MurmurHash3, every bit of the input changes about half of the bits of the output
+	uint64_t mixBits(uint64_t h) {
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDull;
+		h ^= h >> 33;
+		h *= 0xC4CEB9FE1A85EC53ull;
+		h ^= h >> 33;
+		return h;
+	}
+	
+	//hash of all 128 bits of a TGIR
+	//xoring the fields together doesn't work for Sims 2 packages, the type and the group are often the same and cancel out
+	uint64_t hashTgir(const Tgir& key) {
+		return mixBits(mixBits(((uint64_t) key.group << 32) | key.type) ^ (((uint64_t) key.resource << 32) | key.instance));
+	}
+	
+	//hash of the content of an entry, used to find entries that have the same content
+	uint64_t hashContent(Span content) {
+		uint64_t hash = content.size();
+		size_t i = 0;
+		
+		for(; i + 8 <= content.size(); i += 8) {
+			uint64_t word;
+			memcpy(&word, content.data() + i, 8);
+			hash = mixBits(hash ^ word);
 		}
+		
+		uint64_t word = 0;
+		memcpy(&word, content.data() + i, content.size() - i);
+		return mixBits(hash ^ word);
+	}
+	
+	/*hash map from TGIRs to numbers with open addressing, used for the directory of compressed files and for finding repeated TGIRs
+	the keys and the values are kept in flat arrays, a lookup goes through the keys from where the hash points until it finds the key or an empty slot
+	the arrays are never more than half full so that lookups stay short*/
+	class TgirMap {
+		private:
+			vector<Tgir> keys;
+			vector<uint> values;
+			vector<unsigned char> used;
+			size_t count = 0;
+			
+			size_t findSlot(const Tgir& key) const {
+				size_t mask = keys.size() - 1;
+				size_t i = hashTgir(key) & mask;
+				
+				while(used[i] && !(keys[i] == key)) {
+					i = (i + 1) & mask;
+				}
+				
+				return i;
+			}
+			
+			void rehash(size_t capacity) {
+				vector<Tgir> oldKeys = move(keys);
+				vector<uint> oldValues = move(values);
+				vector<unsigned char> oldUsed = move(used);
+				
+				keys = vector<Tgir>(capacity);
+				values = vector<uint>(capacity);
+				used = vector<unsigned char>(capacity);
+				
+				for(size_t i = 0; i < oldKeys.size(); i++) {
+					if(oldUsed[i]) {
+						size_t slot = findSlot(oldKeys[i]);
+						keys[slot] = oldKeys[i];
+						values[slot] = oldValues[i];
+						used[slot] = true;
+					}
+				}
+			}
+			
+		public:
+			TgirMap() {}
+			
+			TgirMap(size_t count) {
+				reserve(count);
+			}
+			
+			//make room for count keys
+			void reserve(size_t count) {
+				size_t capacity = 16;
+				
+				while(capacity < count * 2) {
+					capacity *= 2;
+				}
+				
+				if(capacity > keys.size()) {
+					rehash(capacity);
+				}
+			}
+			
+			//add key with value, if the key is already in the map then the value that was there first is kept
+			//returns the value in the map
+			uint insert(const Tgir& key, uint value) {
+				reserve(count + 1);
+				size_t slot = findSlot(key);
+				
+				if(!used[slot]) {
+					keys[slot] = key;
+					values[slot] = value;
+					used[slot] = true;
+					count++;
+				}
+				
+				return values[slot];
+			}
+			
+			//value for key, or null if the key is not in the map
+			const uint* find(const Tgir& key) const {
+				if(keys.empty()) {
+					return nullptr;
+				}
+				
+				size_t slot = findSlot(key);
+				return used[slot] ? &values[slot] : nullptr;
+			}
+			
+			size_t size() const { return count; }
 	};
 	
 	//representing one package file
@@ -135,58 +426,157 @@ namespace dbpf {
 		Header header;
 		vector<Entry> entries;
 		vector<Hole> holes;
-		unordered_set<CompressedEntry, hashFunction, equalFunction> compressedEntries; //directory of compressed files
+		TgirMap compressedEntries; //directory of compressed files, TGIR to uncompressed size
+	};
+	
+	//the new package written by putPackage, the package it was made from is left as it is
+	//entries are in the same order as in that package, the directory of compressed files is not one of them
+	struct PackageLayout {
+		Header header; //with the index and hole info of the new package
+		vector<EntryLayout> entries;
+		uint clstLocation = 0;
+		uint clstSize = 0; //0 if there is no directory of compressed files
+		uint size = 0;
+		uint shared = 0; //entries that point at the content of an earlier entry instead of having their own
+		bool reordered = false; //entries are not in the same order as in the old file
+		bool written = false; //false if the package was turned down before it was written, see putPackage
+	};
+	
+	const uint CLST_TYPE = 0xE86B1EEF;
+	const uint CLST_GROUP = 0xE86B1EEF;
+	const uint CLST_INSTANCE = 0x286B1F03;
+	
+	//all entries of a package decompressed into one contiguous buffer
+	struct DecompressedPackage {
+		bool unpacked = true;
+		bytes content;
+		vector<size_t> offsets; //entry i is stored from offsets[i] up to offsets[i + 1]
 	};
 	
-	bytes compressEntry(Entry& entry, bytes& content) {
+	/*compression functions
+	the versions taking a span don't copy the content when it stays the same (e.g. when it's read from a mapped file)
+	they return true and put the result in newContent if the content changed, or false if the original content should be kept*/
+	
+	//fastDecode trades some compression for entries that are faster to decompress, see qfs_compress
+	bool compressEntry(Entry& entry, Span content, bytes& newContent, bool fastDecode = false) {
 		if(!entry.compressed && !entry.repeated) {
-			bytes newContent = bytes(content.size() - 1); //must be smaller than the original, otherwise there is no benefit
-			int length = qfs_compress(content.data(), content.size(), newContent.data());
+			newContent = bytes(content.size() - 1); //must be smaller than the original, otherwise there is no benefit
+			int length = qfs_compress(content.data(), content.size(), newContent.data(), fastDecode);
 			
 			if(length > 0) {
 				newContent.resize(length);
 				entry.compressed = true;
-				return newContent;
+				return true;
 			}
 		}
 		
-		return content;
+		return false;
 	}
 
-	bytes decompressEntry(Entry& entry, bytes& content) {
+	bool decompressEntry(Entry& entry, Span content, bytes& newContent) {
 		if(entry.compressed) {
-			bytes newContent = bytes(getUncompressedSize(content));
+			newContent = bytes(getUncompressedSize(content));
 			bool success = qfs_decompress(content.data(), content.size(), newContent.data(), newContent.size(), false);
 			
 			if(success) {
 				entry.compressed = false;
-				return newContent;
+				return true;
 			} else {
 				wcout << L"Failed to decompress entry" << endl;
 			}
 		}
 		
-		return content;
+		return false;
 	}
 	
-	bytes recompressEntry(Entry& entry, bytes& content) {
+	bool recompressEntry(Entry& entry, Span content, bytes& newContent, bool fastDecode = false) {
 		bool wasCompressed = entry.compressed;
 		
-		bytes newContent = decompressEntry(entry, content);
-		newContent = compressEntry(entry, newContent);
+		bytes uncompressedContent;
+		bool decompressed = decompressEntry(entry, content, uncompressedContent);
+		
+		if(!compressEntry(entry, decompressed ? Span(uncompressedContent) : content, newContent, fastDecode)) {
+			if(!decompressed) {
+				return false;
+			}
+			
+			newContent = move(uncompressedContent);
+		}
 		
-		//only return the new entry if there is a reduction in size
+		//only use the new entry if there is a reduction in size
 		if(newContent.size() < content.size()) {
-			return newContent;
+			return true;
 		} else {
 			entry.compressed = wasCompressed;
-			return content;
+			return false;
 		}
 	}
 	
-	//get package infromation from file
-	Package getPackage(fstream& file, wstring displayPath, Mode mode) {
-		file.seekg(0);
+	bytes compressEntry(Entry& entry, bytes& content, bool fastDecode = false) {
+		bytes newContent;
+		return compressEntry(entry, Span(content), newContent, fastDecode) ? newContent : content;
+	}
+	
+	bytes decompressEntry(Entry& entry, bytes& content) {
+		bytes newContent;
+		return decompressEntry(entry, Span(content), newContent) ? newContent : content;
+	}
+	
+	bytes recompressEntry(Entry& entry, bytes& content, bool fastDecode = false) {
+		bytes newContent;
+		return recompressEntry(entry, Span(content), newContent, fastDecode) ? newContent : content;
+	}
+	
+	//decompress only the first length bytes of an entry, content can be just the beginning of the entry
+	//unlike decompressEntry the entry stays marked as compressed since the result is incomplete
+	template<class Buffer>
+	bytes decompressEntryPrefix(Entry& entry, Buffer& content, uint length) {
+		if(entry.compressed && content.size() >= 9) {
+			length = min(length, getUncompressedSize(content));
+			bytes newContent = bytes(length);
+			
+			if(qfs_decompress(content.data(), content.size(), newContent.data(), newContent.size(), true)) {
+				return newContent;
+			} else {
+				wcout << L"Failed to decompress entry" << endl;
+			}
+		}
+		
+		return bytes(content.begin(), content.begin() + min<size_t>(length, content.size()));
+	}
+	
+	//read the first length bytes of the uncompressed entry, reading only as much from the file as needed
+	template<class FileType>
+	bytes readEntryPrefix(FileType& file, Entry& entry, uint length) {
+		if(!entry.compressed) {
+			auto content = readFile(file, entry.location, min(length, entry.size));
+			return bytes(content.begin(), content.end());
+		}
+		
+		uint size = min((uint) qfs_prefix_bound(min(length, 0xFFFFFFu)), entry.size);
+		auto content = readFile(file, entry.location, size);
+		
+		if(content.size() >= 9) {
+			uint prefixLength = min(length, getUncompressedSize(content));
+			bytes newContent = bytes(prefixLength);
+			
+			if(qfs_decompress(content.data(), content.size(), newContent.data(), newContent.size(), true)) {
+				return newContent;
+			}
+		}
+		
+		//the bound does not hold for some unusual streams, retry with the whole entry
+		if(size < entry.size) {
+			content = readFile(file, entry.location, entry.size);
+		}
+		
+		return decompressEntryPrefix(entry, content, length);
+	}
+	
+	//get the header and the holes of a package, which is enough to tell if it's a Sims 2 package and if it has the compressor's signature
+	//the index is not read, so this is quick for any size of package
+	template<class FileType>
+	Package getPackageHeader(FileType& file, wstring displayPath) {
 		uint fileSize = getFileSize(file);
 		
 		if(fileSize < 96) {
@@ -197,7 +587,7 @@ namespace dbpf {
 		Package package = Package();
 		
 		//header
-		bytes buffer = readFile(file, 0, 96);
+		auto buffer = readFile(file, 0, 96);
 		uint pos = 0;
 		
 		//package file magic header "DBPF" should be the first 4 bytes of any dbpf package file
@@ -243,18 +633,18 @@ namespace dbpf {
 		}
 		
 		//boundary checks
-		if(package.header.indexLocation > fileSize || package.header.indexLocation + package.header.indexSize > fileSize) {
+		if((size_t) package.header.indexLocation + package.header.indexSize > fileSize) {
 			wcout << displayPath << L": Entry index outside of bounds" << endl;
 			return Package{false};
 		}
 		
 		//check if the index entry count and the index size match up
 		//NOTE: this is likely unnecessary but I'll still leave it there
-		uint indexEntryCountToIndexSize = 0;
+		size_t indexEntryCountToIndexSize = 0;
 		if(package.header.indexMinorVersion == 2) {
-			indexEntryCountToIndexSize = package.header.indexEntryCount * 4 * 6;
+			indexEntryCountToIndexSize = (size_t) package.header.indexEntryCount * 4 * 6;
 		} else {
-			indexEntryCountToIndexSize = package.header.indexEntryCount * 4 * 5;
+			indexEntryCountToIndexSize = (size_t) package.header.indexEntryCount * 4 * 5;
 		}
 		
 		if(indexEntryCountToIndexSize > package.header.indexSize) {
@@ -263,13 +653,13 @@ namespace dbpf {
 		}
 		
 		//boundary checks
-		if(package.header.holeIndexLocation > fileSize || package.header.holeIndexLocation + package.header.holeIndexSize > fileSize) {
+		if((size_t) package.header.holeIndexLocation + package.header.holeIndexSize > fileSize) {
 			wcout << displayPath << L": Hole index outside of bounds" << endl;
 			return Package{false};
 		}
 		
 		//check if the hole index entry count and the hole index size match up
-		if(package.header.holeIndexEntryCount * 8 != package.header.holeIndexSize) {
+		if((size_t) package.header.holeIndexEntryCount * 8 != package.header.holeIndexSize) {
 			wcout << displayPath << L": Hole count larger than hole index size" << endl;
 			return Package{false};
 		}
@@ -307,7 +697,7 @@ namespace dbpf {
 			Hole hole = package.holes[0];
 			
 			//boundary checks
-			if(hole.location > fileSize || hole.location + hole.size > fileSize) {
+			if((size_t) hole.location + hole.size > fileSize) {
 				wcout << displayPath << L": Hole location outside of bounds" << endl;
 				return Package{false}; 
 			}
@@ -324,32 +714,40 @@ namespace dbpf {
 			}
 		}
 		
-		//index
-		buffer = readFile(file, package.header.indexLocation, package.header.indexSize);
-		pos = 0;
+		return package;
+	}
+	
+	//read the index and the directory of compressed files into a package that getPackageHeader returned
+	//returns false if the index is broken, the error is printed here
+	//with a mapped file the index and the CLST are parsed in place without copying
+	template<class FileType>
+	bool getPackageEntries(FileType& file, wstring displayPath, Package& package, Mode mode) {
+		uint fileSize = getFileSize(file);
+		
+		//index, converted to integers all at once and then split into entries
+		auto buffer = readFile(file, package.header.indexLocation, package.header.indexSize);
+		uint fieldCount = package.header.indexMinorVersion == 2 ? 6 : 5;
+		vector<uint> index = vector<uint>((size_t) package.header.indexEntryCount * fieldCount);
+		getInts(buffer, 0, index.data(), index.size());
 		
 		package.entries.reserve(package.header.indexEntryCount + 1);
-		bytes clstContent;
+		auto clstContent = readFile(file, 0, 0);
 		
 		for(uint i = 0; i < package.header.indexEntryCount; i++) {
-			uint type = getInt(buffer, pos);
-			uint group = getInt(buffer, pos);
-			uint instance = getInt(buffer, pos);
-			uint resource = 0;
-
-			if(package.header.indexMinorVersion == 2) {
-				resource = getInt(buffer, pos);
-			}
-
-			uint location = getInt(buffer, pos);
-			uint size = getInt(buffer, pos);
+			const uint* fields = index.data() + (size_t) i * fieldCount;
+			uint type = fields[0];
+			uint group = fields[1];
+			uint instance = fields[2];
+			uint resource = fieldCount == 6 ? fields[3] : 0;
+			uint location = fields[fieldCount - 2];
+			uint size = fields[fieldCount - 1];
 			
-			if(location > fileSize || location + size > fileSize) {
+			if((size_t) location + size > fileSize) {
 				wcout << displayPath << L": Entry location outside of bounds" << endl;
-				return Package{false}; 
+				return false;
 			}
 			
-			if(type == 0xE86B1EEF) {
+			if(type == CLST_TYPE) {
 				clstContent = readFile(file, location, size);
 				
 			} else {
@@ -358,187 +756,1200 @@ namespace dbpf {
 			}
 		}
 		
-		//directory of compressed files
+		//directory of compressed files, a record that is cut off at the end is ignored
 		if(clstContent.size() > 0) {
-			if(package.header.indexMinorVersion == 2) {
-				package.compressedEntries.reserve(clstContent.size() / (4 * 5));
-			} else {
-				package.compressedEntries.reserve(clstContent.size() / (4 * 4));
-			}
+			uint recordSize = package.header.indexMinorVersion == 2 ? 5 : 4;
+			vector<uint> clst = vector<uint>(clstContent.size() / 4 / recordSize * recordSize);
+			getInts(clstContent, 0, clst.data(), clst.size());
 			
-			pos = 0;
-			while(pos < clstContent.size()) {
-				uint type = getInt(clstContent, pos);
-				uint group = getInt(clstContent, pos);
-				uint instance = getInt(clstContent, pos);
-				uint resource = 0;
-
-				if(package.header.indexMinorVersion == 2) {
-					resource = getInt(clstContent, pos);
-				}
-				
-				uint uncompressedSize = getInt(clstContent, pos);
-				package.compressedEntries.insert(CompressedEntry{type, group, instance, resource, uncompressedSize});
+			package.compressedEntries.reserve(clst.size() / recordSize);
+			
+			for(size_t i = 0; i < clst.size(); i += recordSize) {
+				Tgir key = Tgir{clst[i], clst[i + 1], clst[i + 2], recordSize == 5 ? clst[i + 3] : 0};
+				package.compressedEntries.insert(key, clst[i + recordSize - 1]);
 			}
 			
 			//check if the entries are compressed
 			for(auto& entry: package.entries) {
-				auto iter = package.compressedEntries.find(CompressedEntry{entry.type, entry.group, entry.instance, entry.resource});
-				entry.compressed = iter != package.compressedEntries.end();
+				const uint* uncompressedSize = package.compressedEntries.find(getTgir(entry));
+				entry.compressed = uncompressedSize != nullptr;
 				
 				if(entry.compressed) {
-					entry.uncompressedSize = iter->uncompressedSize;
+					entry.uncompressedSize = *uncompressedSize;
 				}
 			}
 		}
 		
 		//check if entries with repeated TGIRs exist (we don't want to compress those)
 		if(mode == RECOMPRESS) {
-			unordered_map<Entry, uint, hashFunction, equalFunction> entriesMap;
-			entriesMap.reserve(package.entries.size());
+			TgirMap entriesMap = TgirMap(package.entries.size());
 			
 			for(uint i = 0; i < package.entries.size(); i++) {
-				auto iter = entriesMap.find(package.entries[i]);
-				if(iter != entriesMap.end()) {
-					uint j = iter->second;
-
+				uint j = entriesMap.insert(getTgir(package.entries[i]), i);
+				
+				if(j != i) {
 					package.entries[i].repeated = true;
 					package.entries[j].repeated = true;
-
-				} else {
-					entriesMap[package.entries[i]] = i;
 				}
 			}
 		}
 
-		return package;
+		return true;
 	}
-
-	//put package in file
-	void putPackage(fstream& newFile, fstream& oldFile, Package& package, Mode mode) {
-		//write header
-		bytes buffer = bytes(96);
-		uint pos = 0;
-		
-		putInt(buffer, pos, DBPF_MAGIC);
-		putInt(buffer, pos, package.header.majorVersion);
-		putInt(buffer, pos, package.header.minorVersion);
-		putInt(buffer, pos, package.header.majorUserVersion);
-		putInt(buffer, pos, package.header.minorUserVersion);
-		putInt(buffer, pos, package.header.flags);
-		putInt(buffer, pos, package.header.createdDate);
-		putInt(buffer, pos, package.header.modifiedDate);
-		putInt(buffer, pos, package.header.indexMajorVersion);
-		pos += 24; //skip index and hole info, update later
-		putInt(buffer, pos, package.header.indexMinorVersion);
-		copy(package.header.remainder.begin(), package.header.remainder.end(), buffer.begin() + 64);
-
-		writeFile(newFile, buffer);
-
-		//compress and write entries, and save the location and size for the index
-		omp_lock_t r_lock;
-		omp_lock_t w_lock;
+	
+	//get package infromation from file
+	template<class FileType>
+	Package getPackage(FileType& file, wstring displayPath, Mode mode) {
+		Package package = getPackageHeader(file, displayPath);
 		
-		omp_init_lock(&r_lock);
-		omp_init_lock(&w_lock);
+		if(package.unpacked && !getPackageEntries(file, displayPath, package, mode)) {
+			return Package{false};
+		}
 		
-		#pragma omp parallel for
-		for(int i = 0; i < package.entries.size(); i++) {
-			auto& entry = package.entries[i];
+		return package;
+	}
+	
+	/*a package opened to look at a few of it's entries, for tools that inspect packages instead of compressing them
+	open() only reads the header and the holes, the index and the CLST are read the first time they're needed
+	both go through the same checks as getPackage, read() doesn't copy anything for mapped files*/
+	template<class FileType = MappedFile>
+	class PackageView {
+		private:
+			FileType file;
+			wstring displayPath;
+			Package package = Package{false};
+			bool indexed = false;
+			TgirMap lookup; //TGIR to the first entry that has it
+			
+			bool index() {
+				if(package.unpacked && !indexed) {
+					indexed = true;
+					
+					if(!getPackageEntries(file, displayPath, package, SKIP)) {
+						package = Package{false};
+						return false;
+					}
+					
+					lookup.reserve(package.entries.size());
+					
+					for(uint i = 0; i < package.entries.size(); i++) {
+						lookup.insert(getTgir(package.entries[i]), i);
+					}
+				}
+				
+				return package.unpacked;
+			}
 			
-			omp_set_lock(&r_lock);
-			bytes content = readFile(oldFile, entry.location, entry.size);
-			omp_unset_lock(&r_lock);
+		public:
+			PackageView() {}
+			PackageView(const PackageView&) = delete;
+			PackageView& operator=(const PackageView&) = delete;
 			
-			if(mode == RECOMPRESS) {
-				content = recompressEntry(entry, content);
-			} else if(mode == DECOMPRESS) {
-				content = decompressEntry(entry, content);
+			//returns false if the file can't be opened or is not a Sims 2 package, the error is printed with displayPath
+			bool open(const filesystem::path& path, wstring displayPath) {
+				close();
+				this->displayPath = displayPath;
+				
+				if(!file.open(path)) {
+					wcout << displayPath << L": Failed to open file" << endl;
+					return false;
+				}
+				
+				package = getPackageHeader(file, displayPath);
+				return package.unpacked;
 			}
 			
-			entry.size = content.size();
+			void close() {
+				file.close();
+				package = Package{false};
+				indexed = false;
+				lookup = TgirMap();
+			}
 			
-			//we only care about the uncompressed size if the file is compressed
-			if(entry.compressed) {
-				entry.uncompressedSize = getUncompressedSize(content);
+			bool is_open() const { return package.unpacked; }
+			Header& getHeader() { return package.header; }
+			bool hasSignature() const { return package.signature_in_package; }
+			
+			//all entries except for the CLST, empty if the index is broken
+			vector<Entry>& getEntries() {
+				index();
+				return package.entries;
 			}
 			
-			omp_set_lock(&w_lock);
+			//the entry with this TGIR or null if there is none, if several entries have it then the first one is returned
+			Entry* find(uint type, uint group, uint instance, uint resource = 0) {
+				if(!index()) {
+					return nullptr;
+				}
+				
+				const uint* i = lookup.find(Tgir{type, group, instance, resource});
+				return i != nullptr ? &package.entries[*i] : nullptr;
+			}
 			
-			entry.location = newFile.tellp();
-			writeFile(newFile, content);
+			//the entry as it is in the file, for mapped files this points into the file and stays valid until the view is closed
+			auto read(const Entry& entry) {
+				return readFile(file, entry.location, entry.size);
+			}
 			
-			omp_unset_lock(&w_lock);
+			//the entry decompressed, entries that are not compressed or can't be decompressed are given as they are
+			bytes readDecompressed(const Entry& entry) {
+				auto data = read(entry);
+				Span content = data;
+				
+				Entry copy = entry;
+				bytes newContent;
+				
+				if(copy.compressed && content.size() >= 9 && decompressEntry(copy, content, newContent)) {
+					return newContent;
+				}
+				
+				return bytes(content.begin(), content.end());
+			}
+	};
+
+	//size of an entry after decompressing it, or the size of the entry as it is if it's not compressed
+	template<class FileType>
+	uint getDecompressedSize(FileType& file, Entry& entry) {
+		if(entry.compressed && entry.size >= 9) {
+			return getUncompressedSize(readFile(file, entry.location, 9));
 		}
 		
-		omp_destroy_lock(&r_lock);
-		omp_destroy_lock(&w_lock);
+		return entry.size;
+	}
+	
+	//decompress all entries of a package in parallel into memory
+	template<class FileType>
+	DecompressedPackage decompressPackage(FileType& file, Package& package, wstring displayPath) {
+		DecompressedPackage decompressed = DecompressedPackage();
 		
-		//make and write the directory of compressed files
-		bytes clstContent;
-		pos = 0;
+		/*the size of every entry is known from the index and the compression headers, so the layout is decided up front
+		a compression header can't hold more than 16 MB, and a CLST that disagrees with it is rejected before anything is allocated*/
+		decompressed.offsets.reserve(package.entries.size() + 1);
+		decompressed.offsets.push_back(0);
 		
-		if(package.header.indexMinorVersion == 2) {
-			clstContent = bytes(package.entries.size() * 4 * 5);
-		} else {
-			clstContent = bytes(package.entries.size() * 4 * 4);
+		for(auto& entry: package.entries) {
+			size_t size = getDecompressedSize(file, entry);
+			
+			if(entry.compressed && size != entry.uncompressedSize) {
+				wcout << displayPath << L": Uncompressed size of entry does not match the compression header" << endl;
+				return DecompressedPackage{false};
+			}
+			
+			decompressed.offsets.push_back(decompressed.offsets.back() + size);
 		}
 		
-		Entry clst = Entry{0xE86B1EEF, 0xE86B1EEF, 0x286B1F03, 0, (uint) newFile.tellp(), 0};
-
-		for(auto& entry: package.entries) {
+		decompressed.content = bytes(decompressed.offsets.back());
+		
+		//every kind of file is read by position, so the entries are read in parallel too
+		bool success = true;
+		
+		#pragma omp parallel for reduction(&&:success)
+		for(size_t i = 0; i < package.entries.size(); i++) {
+			auto& entry = package.entries[i];
+			unsigned char* dst = decompressed.content.data() + decompressed.offsets[i];
+			
 			if(entry.compressed) {
-				putInt(clstContent, pos, entry.type);
-				putInt(clstContent, pos, entry.group);
-				putInt(clstContent, pos, entry.instance);
-
-				if(package.header.indexMinorVersion == 2) {
-					putInt(clstContent, pos, entry.resource);
-				}
+				auto content = readFile(file, entry.location, entry.size);
+				success = qfs_decompress(content.data(), content.size(), dst, entry.uncompressedSize, false) && success;
 				
-				putInt(clstContent, pos, entry.uncompressedSize);
+			} else {
+				readFile(file, entry.location, entry.size, decompressed.content, decompressed.offsets[i]);
 			}
 		}
 		
-		clst.size = pos;
-		
-		if(clst.size > 0) { 
-			clstContent.resize(clst.size);
-			writeFile(newFile, clstContent);
-			package.entries.push_back(clst);
+		if(!success) {
+			wcout << displayPath << L": Failed to decompress entry" << endl;
+			return DecompressedPackage{false};
 		}
+		
+		return decompressed;
+	}
 
-		//write the index
-		uint indexStart = newFile.tellp();
+	//how many bytes of entries are held in memory at once by default when going through a whole package
+	//in putPackage half of it goes to reading the old file, the other half to entries waiting to be written
+	const size_t DEFAULT_BUDGET = 16 * 1024 * 1024;
+	
+	//indices of the entries in the order they are in the file
+	vector<uint> getFileOrder(vector<Entry>& entries) {
+		vector<uint> order = vector<uint>(entries.size());
 		
-		if(package.header.indexMinorVersion == 2) {
-			buffer = bytes(package.entries.size() * 4 * 6);
-		} else {
-			buffer = bytes(package.entries.size() * 4 * 5);
+		for(uint i = 0; i < order.size(); i++) {
+			order[i] = i;
 		}
 		
-		pos = 0;
-		
-		for(auto& entry: package.entries) {
-			putInt(buffer, pos, entry.type);
-			putInt(buffer, pos, entry.group);
-			putInt(buffer, pos, entry.instance);
-
-			if(package.header.indexMinorVersion == 2) {
-				putInt(buffer, pos, entry.resource);
+		stable_sort(order.begin(), order.end(), [&](uint a, uint b) { return entries[a].location < entries[b].location; });
+		return order;
+	}
+	
+	/*how entries are laid out in a new package, so that the resources the game loads together sit next to each other
+	entries that are in the trace go first, in the order they are in it, the rest are sorted by the key
+	the key is made of the letters t, g, i, and r for type, group, instance, and resource, the first letter matters the most
+	entries that are the same by both stay in the order they are in the old file, so the default keeps the old order*/
+	struct Ordering {
+		string key;
+		vector<Tgir> trace;
+	};
+	
+	//the key can only have each of t, g, i, and r once
+	bool isValidOrderingKey(const string& key) {
+		for(uint i = 0; i < key.size(); i++) {
+			if(string("tgir").find(key[i]) == string::npos || key.find(key[i], i + 1) != string::npos) {
+				return false;
+			}
+		}
+		
+		return true;
+	}
+	
+	//the field of an entry that a letter of the key stands for
+	uint getKeyField(const Entry& entry, char field) {
+		switch(field) {
+			case 't': return entry.type;
+			case 'g': return entry.group;
+			case 'i': return entry.instance;
+			default: return entry.resource;
+		}
+	}
+	
+	//indices of the entries in the order they go in the new file
+	vector<uint> getWriteOrder(vector<Entry>& entries, const Ordering& ordering) {
+		vector<uint> order = getFileOrder(entries);
+		
+		if(ordering.key.empty() && ordering.trace.empty()) {
+			return order;
+		}
+		
+		//where each entry is in the trace, entries that are not in it go after all of those that are
+		vector<uint> tracePos = vector<uint>(entries.size(), UINT32_MAX);
+		
+		if(!ordering.trace.empty()) {
+			TgirMap positions;
+			positions.reserve(ordering.trace.size());
+			
+			for(uint i = 0; i < ordering.trace.size(); i++) {
+				positions.insert(ordering.trace[i], i);
 			}
+			
+			for(uint i = 0; i < entries.size(); i++) {
+				const uint* pos = positions.find(getTgir(entries[i]));
+				
+				if(pos != nullptr) {
+					tracePos[i] = *pos;
+				}
+			}
+		}
+		
+		stable_sort(order.begin(), order.end(), [&](uint a, uint b) {
+			if(tracePos[a] != tracePos[b]) {
+				return tracePos[a] < tracePos[b];
+			}
+			
+			for(char field: ordering.key) {
+				uint fieldA = getKeyField(entries[a], field);
+				uint fieldB = getKeyField(entries[b], field);
+				
+				if(fieldA != fieldB) {
+					return fieldA < fieldB;
+				}
+			}
+			
+			return false;
+		});
+		
+		return order;
+	}
+	
+	//getDecompressedSize for every entry, the file is gone through from start to end and mapped pages are let go of every budget bytes
+	template<class FileType>
+	vector<uint> getDecompressedSizes(FileType& file, vector<Entry>& entries, size_t budget) {
+		vector<uint> sizes = vector<uint>(entries.size());
+		uint released = 0;
+		
+		for(uint i: getFileOrder(entries)) {
+			sizes[i] = getDecompressedSize(file, entries[i]);
+			
+			if(entries[i].location - released > budget) {
+				file.advise(RELEASE);
+				released = entries[i].location;
+			}
+		}
+		
+		return sizes;
+	}
+	
+	//upper bound for the size of the package written by putPackage
+	//the new file is created with this size and is cut down to the actual size at the end
+	template<class FileType>
+	size_t getMaxPackageSize(FileType& oldFile, Package& package, Mode mode, size_t budget = DEFAULT_BUDGET) {
+		size_t size = 96;
+		vector<uint> uncompressedSizes;
+		
+		if(mode == DECOMPRESS) {
+			uncompressedSizes = getDecompressedSizes(oldFile, package.entries, budget);
+		}
+		
+		for(uint i = 0; i < package.entries.size(); i++) {
+			size += package.entries[i].size;
+			
+			//recompressed entries are never larger than the original ones, decompressed entries take the size in their compression header
+			if(mode == DECOMPRESS) {
+				size += uncompressedSizes[i] > package.entries[i].size ? uncompressedSizes[i] - package.entries[i].size : 0;
+			}
+		}
+		
+		//CLST, index including the CLST, hole index and signature
+		size += package.entries.size() * 4 * 5 + (package.entries.size() + 1) * 4 * 6 + 16;
+		return size;
+	}
 
-			putInt(buffer, pos, entry.location);
-			putInt(buffer, pos, entry.size);
+	//gaps between entries up to this size are read along with the entries instead of starting another read
+	const uint READ_GAP_SIZE = 4096;
+	
+	//a part of the old file that is read at once and the entries in it
+	struct ReadRange {
+		uint location;
+		uint size;
+		vector<uint> entries; //indices into package.entries
+		bool read = true; //false for an entry that is copied over without being read
+		uint newSize = 0; //bytes taken by the entries in the new file when decompressing
+	};
+	
+	//entries that are copied to the new file as they are, without looking at their content
+	bool isPassthrough(Entry& entry, Mode mode) {
+		return mode == COMPACT || (!entry.compressed && (mode == DECOMPRESS || (mode == RECOMPRESS && entry.repeated)));
+	}
+	
+	//whether the new package gets the compressor's signature, compacting a package keeps the signature if it had one
+	bool putsSignature(Package& package, Mode mode) {
+		return mode == RECOMPRESS || (mode == COMPACT && package.signature_in_package);
+	}
+	
+	//size of a package after compacting it, entries that are at the same place in the old file are only counted once
+	size_t getCompactSize(Package& package) {
+		size_t size = 96;
+		uint fieldCount = package.header.indexMinorVersion == 2 ? 6 : 5;
+		uint compressedCount = 0;
+		vector<uint> order = getFileOrder(package.entries);
+		
+		for(uint k = 0; k < order.size(); k++) {
+			auto& entry = package.entries[order[k]];
+			bool seen = false;
+			
+			for(uint j = k; j-- > 0 && package.entries[order[j]].location == entry.location;) {
+				if(package.entries[order[j]].size == entry.size) {
+					seen = true;
+					break;
+				}
+			}
+			
+			if(!seen) {
+				size += entry.size;
+			}
+			
+			if(entry.compressed) {
+				compressedCount++;
+			}
+		}
+		
+		//CLST and the index including the CLST
+		if(compressedCount > 0) {
+			size += compressedCount * (fieldCount - 1) * 4 + fieldCount * 4;
 		}
 		
-		writeFile(newFile, buffer);
-		uint indexEnd = newFile.tellp();
+		size += package.entries.size() * fieldCount * 4;
+		
+		//hole index and signature
+		if(putsSignature(package, COMPACT)) {
+			size += 16;
+		}
 		
-		//write compressor signature as a hole and write the hole index
+		return size;
+	}
+	
+	//group the entries into ranges of up to maxSize bytes in the given order, which is the order they are in the file unless they are being laid out differently
+	//only entries that follow each other in the file share a range, so that in the usual case the file is read from start to end
+	//entries marked in unread get a range of their own that is not read
+	//newSizes is the size of each entry in the new file if it's known ahead of time, the ranges are kept under maxSize bytes of those too
+	vector<ReadRange> getReadRanges(vector<Entry>& entries, vector<uint>& order, vector<bool>& unread, uint maxSize, vector<uint>& newSizes) {
+		vector<ReadRange> ranges;
+		
+		for(uint index: order) {
+			auto& entry = entries[index];
+			uint newSize = newSizes.empty() ? 0 : newSizes[index];
+			
+			if(unread[index]) {
+				ranges.push_back(ReadRange{entry.location, entry.size, vector<uint>(1, index), false, newSize});
+				continue;
+			}
+			
+			if(!ranges.empty() && ranges.back().read) {
+				auto& range = ranges.back();
+				uint rangeEnd = range.location + range.size;
+				uint newEnd = max(rangeEnd, entry.location + entry.size);
+				
+				if(entry.location >= range.location && entry.location <= rangeEnd + READ_GAP_SIZE && newEnd - range.location <= maxSize && range.newSize + newSize <= maxSize) {
+					range.size = newEnd - range.location;
+					range.newSize += newSize;
+					range.entries.push_back(index);
+					continue;
+				}
+			}
+			
+			ranges.push_back(ReadRange{entry.location, entry.size, vector<uint>(1, index), true, newSize});
+		}
+		
+		return ranges;
+	}
+	
+	/*in DECOMPRESS mode the size of every entry in the new file is known before anything is decompressed
+	each entry gets enough space to be written as it is in case it can't be decompressed*/
+	template<class FileType>
+	vector<uint> getDecompressedSlotSizes(FileType& oldFile, Package& package, size_t budget) {
+		vector<uint> sizes = getDecompressedSizes(oldFile, package.entries, budget);
+		
+		for(uint i = 0; i < sizes.size(); i++) {
+			sizes[i] = max(sizes[i], package.entries[i].size);
+		}
+		
+		return sizes;
+	}
+	
+	//returns where each entry goes in the new file, in the order of the ranges, with the end of the last entry at the end
+	vector<uint> getDecompressedLayout(vector<ReadRange>& ranges, vector<uint>& slotSizes, uint filePos) {
+		vector<uint> offsets;
+		offsets.reserve(slotSizes.size() + 1);
+		offsets.push_back(filePos);
+		
+		for(auto& range: ranges) {
+			for(uint index: range.entries) {
+				offsets.push_back(offsets.back() + slotSizes[index]);
+			}
+		}
+		
+		return offsets;
+	}
+	
+	//decompress an entry straight into its place in the new file, there is no copy if the new file is in memory
+	//an entry that can't be decompressed is written as it is
+	template<class FileType>
+	void putDecompressedEntry(FileType& newFile, EntryLayout& entry, Span content, uint location) {
+		entry.location = location;
+		
+		if(entry.compressed && content.size() >= 9) {
+			uint size = getUncompressedSize(content);
+			unsigned char* dst = getWritePointer(newFile, location);
+			bytes buf;
+			
+			if(dst == nullptr) {
+				buf = bytes(size);
+				dst = buf.data();
+			}
+			
+			if(qfs_decompress(content.data(), content.size(), dst, size, false)) {
+				if(!buf.empty()) {
+					writeFile(newFile, location, buf);
+				}
+				
+				entry.compressed = false;
+				entry.size = size;
+				return;
+			}
+			
+			wcout << L"Failed to decompress entry" << endl;
+		}
+		
+		entry.size = content.size();
+		writeFile(newFile, location, content);
+	}
+	
+	/*in-place decompression, for new files that can't be written to directly
+	the compressed entry is read on its own into the tail of a buffer sized for the uncompressed entry plus a safety margin, then it's decompressed front to back over itself
+	this way only one buffer is alive per entry instead of one for the compressed entry and one for the uncompressed entry
+	
+	literal runs are the only commands that take more bytes from the compressed entry than they output (1 extra byte per 4 to 112 bytes)
+	so a small margin is enough for almost all entries, the exact margin is checked with qfs_inplace_margin before decompressing*/
+	template<class NewFileType, class FileType>
+	void putDecompressedEntryInPlace(NewFileType& newFile, FileType& oldFile, EntryLayout& entry, uint location) {
+		uint oldLocation = entry.location;
+		entry.location = location;
+		
+		if(entry.size >= 9) {
+			bytes buf = bytes(max(entry.uncompressedSize + entry.size / 64 + 16, entry.size));
+			uint pos = buf.size() - entry.size;
+			readFile(oldFile, oldLocation, entry.size, buf, pos);
+			
+			uint size = getUncompressedSize(buf, pos);
+			int margin = qfs_inplace_margin(buf.data() + pos, entry.size);
+			
+			if(margin >= 0) {
+				//the size in the CLST was wrong or the margin was too small, move the compressed entry to the tail of a larger buffer
+				if((size_t) size + margin > buf.size()) {
+					size_t newSize = (size_t) size + margin;
+					buf.resize(newSize);
+					memmove(buf.data() + newSize - entry.size, buf.data() + pos, entry.size);
+					pos = newSize - entry.size;
+				}
+				
+				if(qfs_decompress(buf.data() + pos, entry.size, buf.data(), size, false)) {
+					writeFile(newFile, location, Span(buf.data(), size));
+					entry.compressed = false;
+					entry.size = size;
+					return;
+				}
+			}
+			
+			wcout << L"Failed to decompress entry" << endl;
+		}
+		
+		//the buffer could have been written over, so the entry is copied from the old file
+		copyFile(newFile, location, oldFile, oldLocation, entry.size);
+	}
+	
+	/*writes entries to the new file in a fixed order on a thread of its own, so the new file comes out the same no matter how many threads there are
+	workers put each finished entry in a slot of a small ring and mark the slot as ready, only holding the lock to flip the flag
+	the writer takes the entries out in order, copies them into a large buffer, and writes the buffer out when it's full
+	it can also hold everything back, so that the caller can still decide not to write the new file once every entry is done
+	a worker that gets too far ahead of the writer, or would go over the budget for bytes waiting to be written, waits until there is room
+	this keeps the memory held by finished entries bounded*/
+	template<class NewFileType, class FileType>
+	class OrderedWriter {
+		private:
+			static const uint WINDOW = 256; //most entries waiting to be written
+			static const uint BUFFER_SIZE = 4 * 1024 * 1024;
+			
+			struct Slot {
+				atomic<bool> ready;
+				EntryLayout* entry;
+				Span content;
+				bytes newContent; //owns content if the entry was changed
+				bool copy; //copied from oldLocation in the old file with copyFile instead of being written
+				uint oldLocation;
+				bool hashed; //hash is set, only if sharing is on and the content was looked at
+				uint64_t hash;
+			};
+			
+			//content that is already in the new file, by the hash of the content
+			struct Stored {
+				uint location;
+				uint size;
+				bool compressed;
+			};
+			
+			//a part of the new file that is held back, a copy from the old file if there is no content
+			struct Part {
+				uint pos;
+				uint size;
+				uint oldPos;
+				bytes content;
+			};
+			
+			NewFileType& file;
+			FileType& oldFile;
+			uint filePos;
+			uint count;
+			vector<Slot> slots = vector<Slot>(WINDOW);
+			atomic<uint> written; //entries taken out by the writer so far
+			
+			size_t budget;
+			atomic<size_t> held; //bytes of new content waiting in the slots
+			
+			bool share;
+			unordered_map<uint64_t, Stored> stored; //only used by the writer thread
+			unordered_map<uint64_t, uint> copied; //location and size in the old file to the location in the new file of entries that were copied
+			uint shared = 0;
+			
+			bytes buffer;
+			uint bufferPos; //where the buffer goes in the file
+			
+			//entries to copy that are next to each other in both files are copied at once
+			uint copyPos = 0;
+			uint copyOldPos = 0;
+			uint copySize = 0;
+			
+			//while holding nothing is written, what would have been is kept in parts in the order of the file until release
+			bool holding;
+			vector<Part> parts;
+			size_t heldBack = 0; //bytes of content in the parts
+			
+			mutex lock;
+			condition_variable slotReady;
+			condition_variable slotFree;
+			thread writer;
+			
+			//write out the buffer, unless all is set the part of the last block that isn't full yet is kept
+			//so the buffer is written in whole blocks, which direct files can write past the system's cache
+			void flush(bool all = true) {
+				uint size = all || holding ? buffer.size() : (bufferPos + buffer.size()) / BLOCK_SIZE * BLOCK_SIZE - bufferPos;
+				
+				if(size > buffer.size()) {
+					return;
+				}
+				
+				write(bufferPos, Span(buffer.data(), size));
+				buffer.erase(buffer.begin(), buffer.begin() + size);
+				bufferPos += size;
+			}
+			
+			void flushCopy() {
+				if(copySize > 0) {
+					if(holding) {
+						parts.push_back(Part{copyPos, copySize, copyOldPos, bytes()});
+					} else {
+						copyFile(file, copyPos, oldFile, copyOldPos, copySize);
+					}
+					
+					copySize = 0;
+				}
+			}
+			
+			void write(uint pos, Span content) {
+				if(!holding) {
+					writeFile(file, pos, content);
+				} else if(content.size() > 0) {
+					parts.push_back(Part{pos, (uint) content.size(), 0, bytes(content.begin(), content.end())});
+					heldBack += content.size();
+				}
+			}
+			
+			//check that an entry already in the new file has the same bytes as content, so a hash collision doesn't make two entries share
+			//the entry could still be in the buffer, held back, or in a copy that wasn't done yet, in which case it's compared there
+			bool isStored(const Stored& first, Span content) {
+				flushCopy();
+				
+				if(first.location >= bufferPos && first.location + first.size <= bufferPos + buffer.size()) {
+					return memcmp(buffer.data() + (first.location - bufferPos), content.data(), content.size()) == 0;
+				}
+				
+				auto part = upper_bound(parts.begin(), parts.end(), first.location, [](uint location, const Part& part) { return location < part.pos; });
+				
+				if(part != parts.begin()) {
+					--part;
+					
+					if(first.location < part->pos + part->size) {
+						if(part->content.empty()) {
+							auto storedContent = readFile(oldFile, part->oldPos + (first.location - part->pos), first.size);
+							return memcmp(storedContent.data(), content.data(), content.size()) == 0;
+						}
+						
+						return memcmp(part->content.data() + (first.location - part->pos), content.data(), content.size()) == 0;
+					}
+				}
+				
+				flush();
+				auto storedContent = readFile(file, first.location, first.size);
+				return memcmp(storedContent.data(), content.data(), content.size()) == 0;
+			}
+			
+			void run() {
+				for(uint i = 0; i < count; i++) {
+					Slot& slot = slots[i % WINDOW];
+					
+					//the flags the threads wait on are only changed while holding the lock, so no notification is missed
+					{
+						unique_lock<mutex> guard(lock);
+						slotReady.wait(guard, [&]() { return slot.ready.load(memory_order_acquire); });
+					}
+					
+					//an entry with the same content as one already in the file points at that one instead of being written again
+					//entries that are at the same place in the old file stay at the same place in the new one
+					bool isShared = false;
+					uint64_t oldPlace = ((uint64_t) slot.oldLocation << 32) | slot.entry->size;
+					
+					if(slot.copy && slot.entry->size > 0) {
+						auto found = copied.find(oldPlace);
+						
+						if(found != copied.end()) {
+							slot.entry->location = found->second;
+							isShared = true;
+							shared++;
+						}
+					}
+					
+					if(!isShared && slot.hashed) {
+						auto found = stored.find(slot.hash);
+						
+						if(found == stored.end()) {
+							stored.emplace(slot.hash, Stored{filePos, slot.entry->size, slot.entry->compressed});
+						} else if(found->second.size == slot.entry->size && found->second.compressed == slot.entry->compressed && isStored(found->second, slot.content)) {
+							slot.entry->location = found->second.location;
+							isShared = true;
+							shared++;
+						}
+					}
+					
+					if(!isShared) {
+						slot.entry->location = filePos;
+						
+						if(slot.copy) {
+							uint size = slot.entry->size;
+							flush();
+							
+							if(copySize > 0 && copyOldPos + copySize == slot.oldLocation) {
+								copySize += size;
+							} else {
+								flushCopy();
+								copyPos = filePos;
+								copyOldPos = slot.oldLocation;
+								copySize = size;
+							}
+							
+							//copies that are read in by copyFile are kept to the size of the buffer
+							if(copySize >= BUFFER_SIZE) {
+								flushCopy();
+							}
+							
+							filePos += size;
+							bufferPos = filePos;
+						
+						} else {
+							flushCopy();
+							filePos += slot.content.size();
+							
+							//entries that take up more than half of the buffer are written on their own
+							if(slot.content.size() > buffer.capacity() / 2) {
+								flush();
+								write(bufferPos, slot.content);
+								bufferPos += slot.content.size();
+							} else {
+								if(buffer.size() + slot.content.size() > buffer.capacity()) {
+									flush(false);
+								}
+								
+								buffer.insert(buffer.end(), slot.content.begin(), slot.content.end());
+							}
+						}
+					}
+					
+					if(slot.copy && slot.entry->size > 0) {
+						copied.emplace(oldPlace, slot.entry->location);
+					}
+					
+					//what is held back counts toward the budget as well, past it everything is written as it goes
+					if(holding && heldBack + buffer.size() > budget) {
+						release();
+					}
+					
+					size_t size = slot.newContent.size();
+					slot.newContent = bytes();
+					
+					{
+						lock_guard<mutex> guard(lock);
+						held.fetch_sub(size, memory_order_relaxed);
+						slot.ready.store(false, memory_order_relaxed);
+						written.store(i + 1, memory_order_release);
+					}
+					
+					slotFree.notify_all();
+				}
+				
+				flush();
+				flushCopy();
+			}
+			
+			//wait until the i-th entry has a free slot and size more bytes fit in the budget
+			//the entry the writer needs next always gets in, otherwise nothing could move
+			void waitForRoom(uint i, size_t size) {
+				unique_lock<mutex> guard(lock);
+				
+				slotFree.wait(guard, [&]() {
+					uint n = written.load(memory_order_acquire);
+					return i < n + WINDOW && (i == n || held.load(memory_order_relaxed) + size <= budget);
+				});
+				
+				held.fetch_add(size, memory_order_relaxed);
+			}
+			
+		public:
+			//count entries are going to be written to file starting at filePos, entries can be copied from oldFile
+			//budget is roughly how many bytes of new content can wait to be written
+			//if share is set, entries with the same content are only written once and all of them point at it
+			//if hold is set, nothing is written until release is called
+			OrderedWriter(NewFileType& file, FileType& oldFile, uint filePos, uint count, size_t budget, bool share = false, bool hold = false): file(file), oldFile(oldFile), filePos(filePos), count(count), written(0), budget(budget), held(0), share(share), bufferPos(filePos), holding(hold) {
+				for(auto& slot: slots) {
+					slot.ready.store(false);
+				}
+				
+				buffer.reserve(min<size_t>(BUFFER_SIZE, budget / 2));
+				writer = thread(&OrderedWriter::run, this);
+			}
+			
+			OrderedWriter(const OrderedWriter&) = delete;
+			OrderedWriter& operator=(const OrderedWriter&) = delete;
+			
+			~OrderedWriter() {
+				if(writer.joinable()) {
+					writer.join();
+				}
+			}
+			
+			//hand over the i-th entry to write, entry.size has to be set already and entry.location is set by the writer
+			//content has to stay valid until wait(i + 1) returns, newContent is kept by the writer if content points to it
+			void put(uint i, EntryLayout& entry, Span content, bytes& newContent) {
+				bool owned = content.data() == newContent.data() && !newContent.empty();
+				waitForRoom(i, owned ? newContent.size() : 0);
+				
+				Slot& slot = slots[i % WINDOW];
+				slot.entry = &entry;
+				slot.copy = false;
+				
+				if(owned) {
+					slot.newContent = move(newContent);
+					slot.content = Span(slot.newContent);
+				} else {
+					slot.content = content;
+				}
+				
+				slot.hashed = share && entry.size > 0;
+				
+				if(slot.hashed) {
+					slot.hash = hashContent(slot.content);
+				}
+				
+				{
+					lock_guard<mutex> guard(lock);
+					slot.ready.store(true, memory_order_release);
+				}
+				
+				slotReady.notify_one();
+			}
+			
+			//hand over the i-th entry to be copied as it is from the old file
+			//content is what's in the old file if it was read, so that it can be shared with other entries, it has to stay valid as for put
+			void putCopy(uint i, EntryLayout& entry, Span content = Span()) {
+				waitForRoom(i, 0);
+				
+				Slot& slot = slots[i % WINDOW];
+				slot.entry = &entry;
+				slot.content = content; //only looked at to compare with entries that have the same hash
+				slot.copy = true;
+				slot.oldLocation = entry.location;
+				slot.hashed = share && entry.size > 0 && content.size() == entry.size;
+				
+				if(slot.hashed) {
+					slot.hash = hashContent(content);
+				}
+				
+				{
+					lock_guard<mutex> guard(lock);
+					slot.ready.store(true, memory_order_release);
+				}
+				
+				slotReady.notify_one();
+			}
+			
+			//wait until the first n entries are written
+			void wait(uint n) {
+				unique_lock<mutex> guard(lock);
+				slotFree.wait(guard, [&]() { return written.load(memory_order_acquire) >= n; });
+			}
+			
+			//wait for every entry to be written, returns where the entries end in the file
+			uint finish() {
+				writer.join();
+				return filePos;
+			}
+			
+			//how many entries point at the content of an earlier entry, after finish
+			uint getShared() {
+				return shared;
+			}
+			
+			//write out what was held back and stop holding, only after finish unless it's the writer itself
+			void release() {
+				holding = false;
+				size_t done = 0;
+				uint oldEnd = 0; //where the last copy ended in the old file
+				
+				//pages of mapped files are let go of every budget bytes, as putPackage does
+				for(auto& part: parts) {
+					if(part.content.empty()) {
+						copyFile(file, part.pos, oldFile, part.oldPos, part.size);
+						
+						//the pages of the old file between two copies end up mapped as well, since pages around the ones read are mapped with them
+						done += (oldEnd > 0 && part.oldPos >= oldEnd ? part.oldPos - oldEnd : 0) + part.size;
+						oldEnd = part.oldPos + part.size;
+					} else {
+						writeFile(file, part.pos, part.content);
+						done += part.size;
+					}
+					
+					if(done > budget) {
+						oldFile.advise(RELEASE);
+						file.advise(RELEASE);
+						done = 0;
+					}
+				}
+				
+				parts = vector<Part>();
+				heldBack = 0;
+			}
+	};
+	
+	//put one entry of the index in buf at pos
+	void putIndexEntry(bytes& buf, uint& pos, uint indexMinorVersion, uint type, uint group, uint instance, uint resource, uint location, uint size) {
+		putInt(buf, pos, type);
+		putInt(buf, pos, group);
+		putInt(buf, pos, instance);
+
+		if(indexMinorVersion == 2) {
+			putInt(buf, pos, resource);
+		}
+
+		putInt(buf, pos, location);
+		putInt(buf, pos, size);
+	}
+	
+	//put package in file
+	//newFile has to be created with getMaxPackageSize bytes (by create in this version), it's resized to the size of the package at the end
+	//works with mapped files, positional reads and writes, or files in memory, all of them can be used from all threads without a lock
+	//the new file doesn't have to be the same kind as the old one, small packages are put together in memory for example
+	//budget is roughly how many bytes of entries are held in memory at once, what's done with in mapped files is let go of as it goes
+	//package is not changed, where each entry went is returned in the layout instead
+	//entries are written in the order they are in the old file unless ordering says otherwise
+	//keep(layout) is asked whether the new package is wanted once every entry is done, the package is only finished if it is
+	//when recompressing nothing is written until then, new content is held back and entries that stay the same are only noted to be copied
+	//past half the budget of new content everything is written as it goes, and a package that isn't wanted can only be thrown away
+	//create() makes newFile in place of the caller, when all of the new content is sure to fit in what's held back it's only called once keep wants the package
+	template<class NewFileType, class FileType, class Create, class Keep>
+	PackageLayout putPackage(NewFileType& newFile, FileType& oldFile, Package& package, Mode mode, bool fastDecode, size_t budget, const Ordering& ordering, Create create, Keep keep) {
+		//make the header, the index and hole info is filled in at the end
+		bytes header = bytes(96);
+		uint pos = 0;
+		
+		putInt(header, pos, DBPF_MAGIC);
+		putInt(header, pos, package.header.majorVersion);
+		putInt(header, pos, package.header.minorVersion);
+		putInt(header, pos, package.header.majorUserVersion);
+		putInt(header, pos, package.header.minorUserVersion);
+		putInt(header, pos, package.header.flags);
+		putInt(header, pos, package.header.createdDate);
+		putInt(header, pos, package.header.modifiedDate);
+		putInt(header, pos, package.header.indexMajorVersion);
+		pos += 24; //skip index and hole info, update later
+		putInt(header, pos, package.header.indexMinorVersion);
+		copy(package.header.remainder.begin(), package.header.remainder.end(), header.begin() + 64);
+
+		uint filePos = 96;
+		bytes buffer;
+		
+		PackageLayout layout;
+		layout.header = package.header;
+		layout.entries.reserve(package.entries.size());
+		
+		for(auto& entry: package.entries) {
+			layout.entries.push_back(EntryLayout{entry.location, entry.size, entry.uncompressedSize, entry.compressed});
+		}
+		
+		//changed entries only get smaller when recompressing, so the new content can't be more than the old file
+		bool hold = mode == RECOMPRESS;
+		bool createLater = hold && getFileSize(oldFile) <= budget / 2;
+		
+		if(!createLater && !create()) {
+			return layout;
+		}
+
+		//compress and write entries, and save the location and size for the index
+		//the old file is read front to back in large reads, each read is split back into entries which are compressed in parallel
+		//the entries are written in the order they were read, so the new file is the same on every run
+		//when decompressing, the layout is worked out up front and each entry is decompressed straight into its place instead
+		//if the new file can't be written to directly, then compressed entries are read on their own and decompressed in place, see putDecompressedEntryInPlace
+		//if the system can copy between the files by itself, then entries that stay the same are copied that way and are only read if they have to be looked at
+		bool copyEntries = canCopyFile(newFile, oldFile);
+		bool inPlace = mode == DECOMPRESS && getWritePointer(newFile, filePos) == nullptr;
+		vector<bool> unread = vector<bool>(package.entries.size());
+		
+		//when compacting nothing is looked at, entries that are next to each other in the old file are copied at once even if the system can't copy by itself
+		for(uint i = 0; i < package.entries.size(); i++) {
+			unread[i] = ((copyEntries || mode == COMPACT) && isPassthrough(package.entries[i], mode)) || (inPlace && package.entries[i].compressed);
+		}
+		
+		uint chunkLimit = max<size_t>(budget / 2, 1);
+		vector<uint> slotSizes;
+		
+		if(mode == DECOMPRESS) {
+			slotSizes = getDecompressedSlotSizes(oldFile, package, budget);
+		}
+		
+		//when the entries are laid out differently, the old file is read in the new order, entries that stay next to each other are still read at once
+		vector<uint> order = getWriteOrder(package.entries, ordering);
+		layout.reordered = order != getFileOrder(package.entries);
+		
+		vector<ReadRange> ranges = getReadRanges(package.entries, order, unread, chunkLimit, slotSizes);
+		vector<uint> offsets;
+		
+		if(mode == DECOMPRESS) {
+			offsets = getDecompressedLayout(ranges, slotSizes, filePos);
+		}
+		
+		//when recompressing, entries with the same content are stored once, the index can point several entries at the same place
+		//decompressed entries have their places worked out ahead of time so they are all written
+		OrderedWriter<NewFileType, FileType> writer(newFile, oldFile, filePos, mode == DECOMPRESS ? 0 : package.entries.size(), budget / 2, mode == RECOMPRESS, hold);
+		uint sequence = 0; //entries handed out before the current chunk
+		
+		for(uint first = 0, last = 0; first < ranges.size(); first = last) {
+			//read ranges until there is a chunk's worth of entries to hand out
+			//decompressed entries are written straight to the new file, so when decompressing a chunk is also measured by what it writes
+			vector<decltype(readFile(oldFile, 0, 0))> chunks;
+			uint chunkSize = 0;
+			
+			for(last = first; last < ranges.size() && chunkSize < chunkLimit; last++) {
+				if(ranges[last].read) {
+					chunks.push_back(readFile(oldFile, ranges[last].location, ranges[last].size));
+					chunkSize += max(ranges[last].size, ranges[last].newSize);
+				} else {
+					chunks.emplace_back();
+					chunkSize += ranges[last].newSize;
+				}
+			}
+			
+			//where each entry is within the chunks
+			vector<uint> indices;
+			vector<Span> slices;
+			
+			for(uint r = first; r < last; r++) {
+				Span chunk = chunks[r - first];
+				
+				for(uint index: ranges[r].entries) {
+					indices.push_back(index);
+					slices.push_back(ranges[r].read ? Span(chunk.data() + (package.entries[index].location - ranges[r].location), package.entries[index].size) : Span());
+				}
+			}
+			
+			#pragma omp parallel for schedule(dynamic)
+			for(size_t i = 0; i < indices.size(); i++) {
+				auto& entry = layout.entries[indices[i]];
+				
+				Span content = slices[i];
+				
+				if(unread[indices[i]]) {
+					if(mode == DECOMPRESS && entry.compressed) {
+						putDecompressedEntryInPlace(newFile, oldFile, entry, offsets[sequence + i]);
+					} else if(mode == DECOMPRESS) {
+						copyFile(newFile, offsets[sequence + i], oldFile, entry.location, entry.size);
+						entry.location = offsets[sequence + i];
+					} else {
+						writer.putCopy(sequence + i, entry);
+					}
+					
+					continue;
+				}
+				
+				if(mode == DECOMPRESS) {
+					putDecompressedEntry(newFile, entry, content, offsets[sequence + i]);
+					continue;
+				}
+				
+				bytes newContent;
+				bool changed = false;
+				
+				if(mode == RECOMPRESS) {
+					Entry oldEntry = package.entries[indices[i]];
+					changed = recompressEntry(oldEntry, content, newContent, fastDecode);
+					entry.compressed = oldEntry.compressed;
+				}
+				
+				if(changed) {
+					content = Span(newContent);
+				}
+				
+				entry.size = content.size();
+				
+				//we only care about the uncompressed size if the file is compressed
+				if(entry.compressed) {
+					entry.uncompressedSize = getUncompressedSize(content);
+				}
+				
+				//when the writer holds back, entries that stay the same are copied later instead of being kept in memory
+				if(!changed && (copyEntries || hold)) {
+					writer.putCopy(sequence + i, entry, content);
+				} else {
+					writer.put(sequence + i, entry, content, newContent);
+				}
+			}
+			
+			//the entries that weren't changed point into the chunks, they have to be written before the chunks are freed
+			sequence += indices.size();
+			
+			if(mode != DECOMPRESS) {
+				writer.wait(sequence);
+			}
+			
+			//the chunk is done with, pages of mapped files that were touched so far are let go of
+			oldFile.advise(RELEASE);
+			newFile.advise(RELEASE);
+		}
+		
+		filePos = mode == DECOMPRESS ? offsets.back() : writer.finish();
+		layout.shared = writer.getShared();
+		
+		//the directory of compressed files, the index, and the hole are put together and written at once
+		uint tailStart = filePos;
+		bytes tail;
+		
+		//make the directory of compressed files
+		bytes clstContent;
+		pos = 0;
+		
+		if(package.header.indexMinorVersion == 2) {
+			clstContent = bytes(package.entries.size() * 4 * 5);
+		} else {
+			clstContent = bytes(package.entries.size() * 4 * 4);
+		}
+		
+		for(uint i = 0; i < package.entries.size(); i++) {
+			auto& entry = package.entries[i];
+			
+			if(layout.entries[i].compressed) {
+				putInt(clstContent, pos, entry.type);
+				putInt(clstContent, pos, entry.group);
+				putInt(clstContent, pos, entry.instance);
+
+				if(package.header.indexMinorVersion == 2) {
+					putInt(clstContent, pos, entry.resource);
+				}
+				
+				putInt(clstContent, pos, layout.entries[i].uncompressedSize);
+			}
+		}
+		
+		layout.clstLocation = filePos;
+		layout.clstSize = pos;
+		
+		if(layout.clstSize > 0) { 
+			clstContent.resize(layout.clstSize);
+			tail = move(clstContent);
+			filePos += layout.clstSize;
+		}
+
+		//make the index, the directory of compressed files goes last
+		uint indexStart = filePos;
+		uint indexEntryCount = package.entries.size() + (layout.clstSize > 0 ? 1 : 0);
+		
+		if(package.header.indexMinorVersion == 2) {
+			buffer = bytes(indexEntryCount * 4 * 6);
+		} else {
+			buffer = bytes(indexEntryCount * 4 * 5);
+		}
+		
+		pos = 0;
+		
+		for(uint i = 0; i < package.entries.size(); i++) {
+			auto& entry = package.entries[i];
+			putIndexEntry(buffer, pos, package.header.indexMinorVersion, entry.type, entry.group, entry.instance, entry.resource, layout.entries[i].location, layout.entries[i].size);
+		}
+		
+		if(layout.clstSize > 0) {
+			putIndexEntry(buffer, pos, package.header.indexMinorVersion, CLST_TYPE, CLST_GROUP, CLST_INSTANCE, 0, layout.clstLocation, layout.clstSize);
+		}
+		
+		tail.insert(tail.end(), buffer.begin(), buffer.end());
+		filePos += buffer.size();
+		uint indexEnd = filePos;
+		
+		//make the compressor signature as a hole and the hole index
 		uint holeIndexLocation = indexEnd;
 		
-		if(mode == RECOMPRESS) {
+		if(putsSignature(package, mode)) {
 			uint holeLocation = holeIndexLocation + 8;
 			uint fileSize = holeLocation + 8;
 			
@@ -553,26 +1964,106 @@ namespace dbpf {
 			putInt(buffer, pos, SIGNATURE);
 			putInt(buffer, pos, fileSize);
 			
-			writeFile(newFile, buffer);
+			tail.insert(tail.end(), buffer.begin(), buffer.end());
+			filePos += buffer.size();
 		}
-
+		
 		//update the header with index info
-		newFile.seekp(36);
+		layout.header.indexEntryCount = indexEntryCount;
+		layout.header.indexLocation = indexStart;
+		layout.header.indexSize = indexEnd - indexStart;
 		
-		buffer = bytes(24);
-		pos = 0;
+		if(putsSignature(package, mode)) {
+			layout.header.holeIndexEntryCount = 1;
+			layout.header.holeIndexLocation = holeIndexLocation;
+			layout.header.holeIndexSize = 8;
+		} else {
+			layout.header.holeIndexEntryCount = 0;
+			layout.header.holeIndexLocation = 0;
+			layout.header.holeIndexSize = 0;
+		}
 		
-		putInt(buffer, pos, package.entries.size()); //index entry count
-		putInt(buffer, pos, indexStart); //index location
-		putInt(buffer, pos, indexEnd - indexStart); //index size
+		pos = 36;
 		
-		if(mode == RECOMPRESS) {
-			putInt(buffer, pos, 1); //hole index entry count
-			putInt(buffer, pos, holeIndexLocation); //hole index location
-			putInt(buffer, pos, 8); //hole index size
-		} //else the rest is zero
+		putInt(header, pos, layout.header.indexEntryCount);
+		putInt(header, pos, layout.header.indexLocation);
+		putInt(header, pos, layout.header.indexSize);
+		putInt(header, pos, layout.header.holeIndexEntryCount);
+		putInt(header, pos, layout.header.holeIndexLocation);
+		putInt(header, pos, layout.header.holeIndexSize);
+		
+		layout.size = filePos;
+		
+		if(!keep(layout) || (createLater && !create())) {
+			return layout;
+		}
+		
+		writer.release();
+		writeFile(newFile, 0, header);
+		writeFile(newFile, tailStart, tail);
+		
+		//cut the file down to what was written
+		newFile.resize(filePos);
+		layout.written = true;
+		return layout;
+	}
+	
+	//put package in file, the package is always written
+	template<class NewFileType, class FileType>
+	PackageLayout putPackage(NewFileType& newFile, FileType& oldFile, Package& package, Mode mode, bool fastDecode = false, size_t budget = DEFAULT_BUDGET, const Ordering& ordering = Ordering()) {
+		return putPackage(newFile, oldFile, package, mode, fastDecode, budget, ordering, []() { return true; }, [](PackageLayout&) { return true; });
+	}
+	
+	//checks that the entries in the directory of compressed files are exactly the ones with a compression header, with the same uncompressed sizes
+	//this is what validatePackage checks for a new package, here it's checked for a package that is kept as it is
+	template<class FileType>
+	bool checkCompressionInfo(FileType& file, Package& package, size_t budget = DEFAULT_BUDGET) {
+		uint released = 0;
+		
+		for(uint i: getFileOrder(package.entries)) {
+			auto& entry = package.entries[i];
+			auto header = readFile(file, entry.location, min(entry.size, 9u));
+			Span content = header;
+			
+			bool compressed_in_header = content.size() >= 9 && content[4] == 0x10 && content[5] == 0xFB;
+			
+			if(compressed_in_header != entry.compressed || (entry.compressed && getUncompressedSize(content) != entry.uncompressedSize)) {
+				return false;
+			}
+			
+			if(entry.location - released > budget) {
+				file.advise(RELEASE);
+				released = entry.location;
+			}
+		}
+		
+		return true;
+	}
+	
+	/*add the compressor signature to a package of fileSize bytes in place, without writing the rest of the package again
+	the hole index and the hole are added to the end of the file and the hole index info in the header is changed to point to them
+	any holes the package had before are left where they are, they're just not listed anymore*/
+	bool putSignature(File& file, uint fileSize) {
+		uint holeIndexLocation = fileSize;
+		uint holeLocation = holeIndexLocation + 8;
+		
+		bytes buffer = bytes(16);
+		uint pos = 0;
+		
+		putInt(buffer, pos, holeLocation);
+		putInt(buffer, pos, 8); //hole size
+		putInt(buffer, pos, SIGNATURE);
+		putInt(buffer, pos, holeLocation + 8); //file size
+		
+		bytes header = bytes(12);
+		pos = 0;
+		
+		putInt(header, pos, 1); //hole index entry count
+		putInt(header, pos, holeIndexLocation);
+		putInt(header, pos, 8); //hole index size
 		
-		writeFile(newFile, buffer);
+		//the end is written first so the header never points past the end of the file
+		return file.write(fileSize, buffer.size(), buffer.data()) && file.sync() && file.write(48, header.size(), header.data()) && file.sync();
 	}
 	
 }
@@ -0,0 +1,585 @@
+#ifndef FILE_H
+#define FILE_H
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace dbpf {
+
+	//writes are lined up to this many bytes so that direct files can skip the system's cache
+	const size_t BLOCK_SIZE = 4096;
+
+	//hints about how a file is going to be read, passed on to posix_fadvise or madvise (ignored on Windows)
+	//RELEASE drops the parts of a file that this process holds in memory without dropping them from the system's cache, it only does something for mapped files
+	enum Advice { SEQUENTIAL, WILL_NEED, DONT_NEED, RELEASE };
+
+	/*a file mapped to memory
+	open() maps an existing file for reading, create() makes a new file of the given size and maps it for writing
+	the file can be resized later on, which is used to cut a new file down to the size of what was actually written*/
+	class MappedFile {
+		private:
+			unsigned char* ptr = nullptr;
+			size_t length = 0;
+			bool writable = false;
+
+			#ifdef _WIN32
+				HANDLE file = INVALID_HANDLE_VALUE;
+				HANDLE mapping = NULL;
+			#else
+				int fd = -1;
+			#endif
+
+			//map the whole file, nothing is mapped for empty files since they can't be mapped
+			bool map() {
+				if(length == 0) {
+					return true;
+				}
+
+				#ifdef _WIN32
+					mapping = CreateFileMappingW(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, (DWORD) ((unsigned long long) length >> 32), (DWORD) length, NULL);
+
+					if(mapping == NULL) {
+						return false;
+					}
+
+					ptr = (unsigned char*) MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, length);
+					return ptr != nullptr;
+				#else
+					void* addr = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+
+					if(addr == MAP_FAILED) {
+						return false;
+					}
+
+					ptr = (unsigned char*) addr;
+					return true;
+				#endif
+			}
+
+			void unmap() {
+				#ifdef _WIN32
+					if(ptr != nullptr) UnmapViewOfFile(ptr);
+					if(mapping != NULL) CloseHandle(mapping);
+					mapping = NULL;
+				#else
+					if(ptr != nullptr) munmap(ptr, length);
+				#endif
+
+				ptr = nullptr;
+			}
+
+		public:
+			MappedFile() {}
+			MappedFile(const MappedFile&) = delete;
+			MappedFile& operator=(const MappedFile&) = delete;
+
+			~MappedFile() {
+				close();
+			}
+
+			//map an existing file for reading
+			bool open(const std::filesystem::path& path) {
+				close();
+				writable = false;
+
+				#ifdef _WIN32
+					file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+					LARGE_INTEGER size;
+
+					if(file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)) {
+						close();
+						return false;
+					}
+
+					length = size.QuadPart;
+				#else
+					fd = ::open(path.c_str(), O_RDONLY);
+					struct stat st;
+
+					if(fd < 0 || fstat(fd, &st) != 0) {
+						close();
+						return false;
+					}
+
+					length = st.st_size;
+				#endif
+
+				if(!map()) {
+					close();
+					return false;
+				}
+
+				return true;
+			}
+
+			//create a new file (or truncate an existing one) of the given size and map it for writing
+			bool create(const std::filesystem::path& path, size_t size) {
+				close();
+				writable = true;
+
+				#ifdef _WIN32
+					//creating the file mapping extends the file to the size of the mapping
+					file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+					if(file == INVALID_HANDLE_VALUE) {
+						close();
+						return false;
+					}
+				#else
+					fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+					if(fd < 0) {
+						close();
+						return false;
+					}
+
+					//allocate the blocks up front, running out of disk space while writing to a mapping crashes the program instead of failing a write
+					#ifdef __linux__
+						if(size > 0 && posix_fallocate(fd, 0, size) != 0) {
+							close();
+							return false;
+						}
+					#else
+						if(ftruncate(fd, size) != 0) {
+							close();
+							return false;
+						}
+					#endif
+				#endif
+
+				length = size;
+
+				if(!map()) {
+					close();
+					return false;
+				}
+
+				return true;
+			}
+
+			//change the size of a file opened with create(), the contents up to the new size are kept
+			bool resize(size_t size) {
+				if(!writable || !is_open()) {
+					return false;
+				}
+
+				unmap();
+
+				#ifdef _WIN32
+					LARGE_INTEGER newSize;
+					newSize.QuadPart = size;
+
+					if(!SetFilePointerEx(file, newSize, NULL, FILE_BEGIN) || !SetEndOfFile(file)) {
+						close();
+						return false;
+					}
+				#else
+					if(ftruncate(fd, size) != 0) {
+						close();
+						return false;
+					}
+				#endif
+
+				length = size;
+
+				if(!map()) {
+					close();
+					return false;
+				}
+
+				return true;
+			}
+
+			void advise(Advice advice) {
+				#ifndef _WIN32
+					if(ptr != nullptr) {
+						//for shared mappings MADV_DONTNEED only unmaps the pages, changes that were made stay in the file
+						madvise(ptr, length, advice == SEQUENTIAL ? MADV_SEQUENTIAL : advice == WILL_NEED ? MADV_WILLNEED : MADV_DONTNEED);
+					}
+				#endif
+			}
+
+			void close() {
+				unmap();
+
+				#ifdef _WIN32
+					if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+					file = INVALID_HANDLE_VALUE;
+				#else
+					if(fd >= 0) ::close(fd);
+					fd = -1;
+				#endif
+
+				length = 0;
+			}
+
+			bool is_open() const {
+				#ifdef _WIN32
+					return file != INVALID_HANDLE_VALUE;
+				#else
+					return fd >= 0;
+				#endif
+			}
+
+			unsigned char* data() const { return ptr; }
+			size_t size() const { return length; }
+	};
+
+	/*a file accessed with positional reads and writes (pread/pwrite on POSIX, overlapped ReadFile/WriteFile on Windows)
+	reads and writes don't move a shared file position, so several threads can use the same file at once without a lock
+	
+	a file made with create(path, size, true) is direct (Linux only), the whole blocks of every write go past the system's cache with O_DIRECT
+	and the rest of the write goes through the cache as usual, so writing lots of new files doesn't push everything else out of the cache
+	O_DIRECT needs the memory to be lined up too, so the blocks are copied through a lined up buffer on the way*/
+	class File {
+		private:
+			static constexpr size_t DIRECT_BUFFER_SIZE = 1024 * 1024;
+			
+			#ifdef _WIN32
+				HANDLE file = INVALID_HANDLE_VALUE;
+			#else
+				int fd = -1;
+				int directFd = -1; //the same file opened with O_DIRECT, only for direct files
+			#endif
+			
+			bool writeAll(int fd, size_t pos, size_t size, const unsigned char* src) const {
+				#ifndef _WIN32
+					while(size > 0) {
+						ssize_t n = pwrite(fd, src, size, pos);
+						
+						if(n <= 0) {
+							if(n < 0 && errno == EINTR) continue;
+							return false;
+						}
+						
+						src += n;
+						pos += n;
+						size -= n;
+					}
+				#endif
+				
+				return true;
+			}
+			
+			//write the whole blocks between pos and pos + size with O_DIRECT, pos and size have to be multiples of BLOCK_SIZE
+			bool writeDirect(size_t pos, size_t size, const unsigned char* src) const {
+				#ifdef __linux__
+					unsigned char* buf = (unsigned char*) ::operator new(std::min(size, DIRECT_BUFFER_SIZE), std::align_val_t(BLOCK_SIZE));
+					bool success = true;
+					
+					while(success && size > 0) {
+						size_t length = std::min(size, DIRECT_BUFFER_SIZE);
+						memcpy(buf, src, length);
+						
+						//file systems that don't do O_DIRECT fail the write, the cache is used then
+						success = writeAll(directFd, pos, length, buf) || writeAll(fd, pos, length, buf);
+						
+						src += length;
+						pos += length;
+						size -= length;
+					}
+					
+					::operator delete(buf, std::align_val_t(BLOCK_SIZE));
+					return success;
+				#else
+					return false;
+				#endif
+			}
+
+		public:
+			File() {}
+			File(const File&) = delete;
+			File& operator=(const File&) = delete;
+
+			~File() {
+				close();
+			}
+
+			//open an existing file for reading, or for changing it in place if writable is set
+			bool open(const std::filesystem::path& path, bool writable = false) {
+				close();
+
+				#ifdef _WIN32
+					file = CreateFileW(path.c_str(), writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, writable ? 0 : FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+				#else
+					fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+				#endif
+
+				return is_open();
+			}
+
+			//create a new file (or truncate an existing one) for reading and writing
+			//size is how large the file is expected to get, the space is reserved up front where possible to keep the file in one piece
+			bool create(const std::filesystem::path& path, size_t size, bool direct = false) {
+				close();
+
+				#ifdef _WIN32
+					file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+				#else
+					fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+					#ifdef __linux__
+						if(fd >= 0 && size > 0) {
+							fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+						}
+						
+						//if the file system doesn't do O_DIRECT then the file is just not direct
+						if(fd >= 0 && direct) {
+							directFd = ::open(path.c_str(), O_WRONLY | O_DIRECT);
+						}
+					#endif
+				#endif
+
+				return is_open();
+			}
+
+			bool read(size_t pos, size_t size, unsigned char* dst) const {
+				#ifdef _WIN32
+					OVERLAPPED overlapped = {};
+					overlapped.Offset = (DWORD) pos;
+					overlapped.OffsetHigh = (DWORD) ((unsigned long long) pos >> 32);
+
+					DWORD bytesRead = 0;
+					return size == 0 || (ReadFile(file, dst, (DWORD) size, &bytesRead, &overlapped) && bytesRead == size);
+				#else
+					while(size > 0) {
+						ssize_t n = pread(fd, dst, size, pos);
+
+						if(n <= 0) {
+							if(n < 0 && errno == EINTR) continue;
+							return false;
+						}
+
+						dst += n;
+						pos += n;
+						size -= n;
+					}
+
+					return true;
+				#endif
+			}
+
+			bool write(size_t pos, size_t size, const unsigned char* src) const {
+				#ifdef _WIN32
+					OVERLAPPED overlapped = {};
+					overlapped.Offset = (DWORD) pos;
+					overlapped.OffsetHigh = (DWORD) ((unsigned long long) pos >> 32);
+
+					DWORD bytesWritten = 0;
+					return size == 0 || (WriteFile(file, src, (DWORD) size, &bytesWritten, &overlapped) && bytesWritten == size);
+				#else
+					size_t blocksStart = (pos + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+					size_t blocksEnd = (pos + size) / BLOCK_SIZE * BLOCK_SIZE;
+					
+					//the blocks are only written by this write and no other, so they can't be in the cache from a part written before
+					if(directFd < 0 || blocksEnd <= blocksStart) {
+						return writeAll(fd, pos, size, src);
+					}
+					
+					return writeAll(fd, pos, blocksStart - pos, src)
+						&& writeDirect(blocksStart, blocksEnd - blocksStart, src + (blocksStart - pos))
+						&& writeAll(fd, blocksEnd, pos + size - blocksEnd, src + (blocksEnd - pos));
+				#endif
+			}
+
+			//copy size bytes from src at srcPos to pos in this file inside the kernel, without going through user space
+			//file systems with reflinks (btrfs, XFS) share the blocks instead of copying them
+			//returns false if that's not possible for these files, in which case the range has to be copied by hand
+			bool copy(size_t pos, const File& src, size_t srcPos, size_t size) const {
+				#ifdef __linux__
+					loff_t in = srcPos;
+					loff_t out = pos;
+
+					while(size > 0) {
+						ssize_t n = copy_file_range(src.fd, &in, fd, &out, size, 0);
+
+						if(n <= 0) {
+							if(n < 0 && errno == EINTR) continue;
+							return false;
+						}
+
+						size -= n;
+					}
+
+					return true;
+				#else
+					return false;
+				#endif
+			}
+
+			size_t size() const {
+				#ifdef _WIN32
+					LARGE_INTEGER size;
+					return GetFileSizeEx(file, &size) ? size.QuadPart : 0;
+				#else
+					struct stat st;
+					return fstat(fd, &st) == 0 ? st.st_size : 0;
+				#endif
+			}
+
+			//wait until what was written is on the disk
+			bool sync() {
+				#ifdef _WIN32
+					return FlushFileBuffers(file);
+				#else
+					return fsync(fd) == 0;
+				#endif
+			}
+
+			//set the size of the file, used to drop any space reserved by create() that wasn't written to
+			bool resize(size_t size) {
+				#ifdef _WIN32
+					LARGE_INTEGER newSize;
+					newSize.QuadPart = size;
+					return SetFilePointerEx(file, newSize, NULL, FILE_BEGIN) && SetEndOfFile(file);
+				#else
+					return ftruncate(fd, size) == 0;
+				#endif
+			}
+
+			//direct files drop what was read back into the cache on RELEASE as well
+			void advise(Advice advice) {
+				#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+					if(advice == RELEASE && directFd < 0) return;
+					posix_fadvise(fd, 0, 0, advice == SEQUENTIAL ? POSIX_FADV_SEQUENTIAL : advice == WILL_NEED ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED);
+				#endif
+			}
+
+			void close() {
+				#ifdef _WIN32
+					if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+					file = INVALID_HANDLE_VALUE;
+				#else
+					if(fd >= 0) ::close(fd);
+					if(directFd >= 0) ::close(directFd);
+					fd = -1;
+					directFd = -1;
+				#endif
+			}
+
+			bool is_open() const {
+				#ifdef _WIN32
+					return file != INVALID_HANDLE_VALUE;
+				#else
+					return fd >= 0;
+				#endif
+			}
+	};
+
+	/*a whole file held in memory, filled in by whoever read the file (such as the I/O engine)
+	create() only allocates the buffer, nothing is written to disk, the content is taken back with release() and saved by the caller*/
+	class MemoryFile {
+		private:
+			std::vector<unsigned char> content;
+			bool opened = false;
+
+		public:
+			MemoryFile() {}
+			MemoryFile(const MemoryFile&) = delete;
+			MemoryFile& operator=(const MemoryFile&) = delete;
+
+			//take over content that was already read from a file
+			bool open(std::vector<unsigned char>&& data) {
+				content = std::move(data);
+				opened = true;
+				return true;
+			}
+
+			bool create(const std::filesystem::path&, size_t size) {
+				content = std::vector<unsigned char>(size);
+				opened = true;
+				return true;
+			}
+
+			bool resize(size_t size) {
+				content.resize(size);
+				return opened;
+			}
+
+			void advise(Advice) {}
+
+			void close() {
+				content = std::vector<unsigned char>();
+				opened = false;
+			}
+
+			//hand the content over to the caller and close the file
+			std::vector<unsigned char> release() {
+				opened = false;
+				return std::move(content);
+			}
+
+			bool is_open() const { return opened; }
+			unsigned char* data() { return content.data(); }
+			size_t size() const { return content.size(); }
+	};
+
+	/*several files that are read as if they were one, used to put packages together
+	the files are opened by the caller, then place() puts them one after the other in the given order with a gap between each two
+	the gap is so that reads of one file never run into the next, a read has to stay within one file*/
+	template<class FileType>
+	class MergedFile {
+		private:
+			std::vector<FileType> files;
+			std::vector<size_t> offsets; //where each file starts
+			std::vector<size_t> order; //the files by where they start
+			size_t length = 0;
+
+		public:
+			MergedFile(size_t count): files(count), offsets(count) {}
+			MergedFile(const MergedFile&) = delete;
+			MergedFile& operator=(const MergedFile&) = delete;
+
+			FileType& getFile(size_t i) { return files[i]; }
+			size_t getOffset(size_t i) const { return offsets[i]; }
+
+			void place(const std::vector<size_t>& placeOrder, size_t gap) {
+				order = placeOrder;
+				length = 0;
+
+				for(size_t i: order) {
+					offsets[i] = length;
+					length = (length + files[i].size() + gap + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+				}
+			}
+
+			//the file that pos is in
+			size_t find(size_t pos) const {
+				auto next = std::upper_bound(order.begin(), order.end(), pos, [&](size_t pos, size_t i) { return pos < offsets[i]; });
+				return *(next - 1);
+			}
+
+			void advise(Advice advice) {
+				for(auto& file: files) {
+					file.advise(advice);
+				}
+			}
+
+			void close() {
+				for(auto& file: files) {
+					file.close();
+				}
+			}
+
+			size_t size() const { return length; }
+	};
+}
+
+#endif
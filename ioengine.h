@@ -0,0 +1,738 @@
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+//batched I/O for whole packages, Linux only
+#ifdef __linux__
+
+#include "file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dbpf {
+
+	//one operation for the I/O queue, which fields are used depends on the opcode (IORING_OP_*)
+	struct IoRequest {
+		unsigned char opcode = 0;
+		int fd = -1;
+		const char* path = nullptr;
+		const char* newPath = nullptr;
+		int flags = 0;
+		unsigned char* buf = nullptr;
+		unsigned int length = 0;
+		unsigned long long offset = 0;
+		struct statx* stat = nullptr;
+		unsigned long long userData = 0;
+	};
+
+	struct IoCompletion {
+		unsigned long long userData;
+		int result; //what the system call would have returned, or -errno
+	};
+
+	/*a queue of I/O operations that are submitted together and may finish in any order
+	the operations go to an io_uring if the kernel has one with all the needed operations (5.11 and newer)
+	otherwise they are done one by one with the usual system calls when they are submitted*/
+	class IoQueue {
+		private:
+			int ringFd = -1;
+			unsigned int depth;
+
+			void* sqRing = MAP_FAILED;
+			void* cqRing = MAP_FAILED;
+			size_t sqRingSize = 0;
+			size_t cqRingSize = 0;
+			struct io_uring_sqe* sqes = (struct io_uring_sqe*) MAP_FAILED;
+
+			unsigned int* sqHead;
+			unsigned int* sqTail;
+			unsigned int* sqMask;
+			unsigned int* sqArray;
+			unsigned int* cqHead;
+			unsigned int* cqTail;
+			unsigned int* cqMask;
+			struct io_uring_cqe* cqes;
+			unsigned int toSubmit = 0;
+
+			//used instead of the ring
+			std::vector<IoRequest> requests;
+			std::vector<IoCompletion> completed;
+
+			bool setupRing() {
+				struct io_uring_params params;
+				memset(&params, 0, sizeof(params));
+
+				ringFd = syscall(__NR_io_uring_setup, depth, &params);
+
+				//not supported by the kernel or blocked (by seccomp in containers for example)
+				if(ringFd < 0) {
+					return false;
+				}
+
+				//make sure that every operation the engine uses is there
+				size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+				std::vector<unsigned char> probeBuf(probeSize);
+				auto probe = (struct io_uring_probe*) probeBuf.data();
+
+				if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+					return false;
+				}
+
+				for(int op: {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_RENAMEAT}) {
+					if(op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+						return false;
+					}
+				}
+
+				sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+				cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+				if(params.features & IORING_FEAT_SINGLE_MMAP) {
+					sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+				}
+
+				sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+
+				if(sqRing == MAP_FAILED) {
+					return false;
+				}
+
+				if(params.features & IORING_FEAT_SINGLE_MMAP) {
+					cqRing = sqRing;
+				} else {
+					cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+
+					if(cqRing == MAP_FAILED) {
+						return false;
+					}
+				}
+
+				sqes = (struct io_uring_sqe*) mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+
+				if(sqes == MAP_FAILED) {
+					return false;
+				}
+
+				auto sq = (unsigned char*) sqRing;
+				sqHead = (unsigned int*) (sq + params.sq_off.head);
+				sqTail = (unsigned int*) (sq + params.sq_off.tail);
+				sqMask = (unsigned int*) (sq + params.sq_off.ring_mask);
+				sqArray = (unsigned int*) (sq + params.sq_off.array);
+
+				auto cq = (unsigned char*) cqRing;
+				cqHead = (unsigned int*) (cq + params.cq_off.head);
+				cqTail = (unsigned int*) (cq + params.cq_off.tail);
+				cqMask = (unsigned int*) (cq + params.cq_off.ring_mask);
+				cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+				depth = params.sq_entries;
+				return true;
+			}
+
+			void closeRing() {
+				if(sqes != MAP_FAILED) munmap(sqes, depth * sizeof(struct io_uring_sqe));
+				if(cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+				if(sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+				if(ringFd >= 0) ::close(ringFd);
+
+				sqes = (struct io_uring_sqe*) MAP_FAILED;
+				sqRing = cqRing = MAP_FAILED;
+				ringFd = -1;
+			}
+
+			//do one operation right away
+			static int perform(const IoRequest& request) {
+				int result = -1;
+
+				switch(request.opcode) {
+					case IORING_OP_OPENAT:
+						result = ::open(request.path, request.flags, 0644);
+						break;
+
+					case IORING_OP_STATX: {
+						struct stat st;
+						result = fstat(request.fd, &st);
+
+						//st is only filled in if fstat worked, otherwise the job fails with the error
+						if(result == 0) {
+							request.stat->stx_size = st.st_size;
+						}
+
+						break;
+					}
+
+					case IORING_OP_READ:
+						result = pread(request.fd, request.buf, request.length, request.offset);
+						break;
+
+					case IORING_OP_WRITE:
+						result = pwrite(request.fd, request.buf, request.length, request.offset);
+						break;
+
+					case IORING_OP_CLOSE:
+						result = ::close(request.fd);
+						break;
+
+					case IORING_OP_RENAMEAT:
+						result = rename(request.path, request.newPath);
+						break;
+				}
+
+				return result < 0 ? -errno : result;
+			}
+
+		public:
+			//depth is the most operations that can be in flight at once, it should be a power of 2
+			IoQueue(unsigned int depth, bool useRing): depth(depth) {
+				if(useRing && !setupRing()) {
+					closeRing();
+				}
+			}
+
+			IoQueue(const IoQueue&) = delete;
+			IoQueue& operator=(const IoQueue&) = delete;
+
+			~IoQueue() {
+				closeRing();
+			}
+
+			bool is_ring() const { return ringFd >= 0; }
+			unsigned int get_depth() const { return depth; }
+
+			//the caller must not have more than depth operations in flight
+			void push(const IoRequest& request) {
+				if(!is_ring()) {
+					requests.push_back(request);
+					return;
+				}
+
+				unsigned int tail = *sqTail;
+				unsigned int index = tail & *sqMask;
+				struct io_uring_sqe* sqe = &sqes[index];
+				memset(sqe, 0, sizeof(*sqe));
+
+				sqe->opcode = request.opcode;
+				sqe->fd = request.fd;
+				sqe->user_data = request.userData;
+
+				switch(request.opcode) {
+					case IORING_OP_OPENAT:
+						sqe->fd = AT_FDCWD;
+						sqe->addr = (unsigned long long) request.path;
+						sqe->len = 0644;
+						sqe->open_flags = request.flags;
+						break;
+
+					case IORING_OP_STATX:
+						sqe->addr = (unsigned long long) "";
+						sqe->len = STATX_SIZE;
+						sqe->off = (unsigned long long) request.stat;
+						sqe->statx_flags = AT_EMPTY_PATH;
+						break;
+
+					case IORING_OP_READ:
+					case IORING_OP_WRITE:
+						sqe->addr = (unsigned long long) request.buf;
+						sqe->len = request.length;
+						sqe->off = request.offset;
+						break;
+
+					case IORING_OP_RENAMEAT:
+						sqe->fd = AT_FDCWD;
+						sqe->addr = (unsigned long long) request.path;
+						sqe->len = AT_FDCWD;
+						sqe->addr2 = (unsigned long long) request.newPath;
+						break;
+				}
+
+				sqArray[index] = index;
+				__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+				toSubmit++;
+			}
+
+			//start all the pushed operations, if wait is true then this also waits until at least one operation finishes
+			void submit(bool wait) {
+				if(!is_ring()) {
+					for(auto& request: requests) {
+						completed.push_back(IoCompletion{request.userData, perform(request)});
+					}
+
+					requests.clear();
+					return;
+				}
+
+				while(true) {
+					int submitted = syscall(__NR_io_uring_enter, ringFd, toSubmit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+
+					if(submitted >= 0) {
+						toSubmit -= submitted;
+
+						if(toSubmit == 0) {
+							return;
+						}
+
+					} else if(errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+						return;
+					}
+				}
+			}
+
+			//move the finished operations to completions
+			void reap(std::vector<IoCompletion>& completions) {
+				if(!is_ring()) {
+					completions.insert(completions.end(), completed.begin(), completed.end());
+					completed.clear();
+					return;
+				}
+
+				unsigned int head = *cqHead;
+				unsigned int tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+				for(; head != tail; head++) {
+					struct io_uring_cqe* cqe = &cqes[head & *cqMask];
+					completions.push_back(IoCompletion{cqe->user_data, cqe->res});
+				}
+
+				__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+			}
+	};
+
+	/*reads whole packages ahead of time and writes new packages behind, on a thread of its own
+	operations for many packages are in flight at once, so the disk stays busy while the packages are being compressed
+	and a package costs a handful of queued operations instead of a series of blocking system calls*/
+	class IoEngine {
+		private:
+			static const unsigned int QUEUE_DEPTH = 64;
+			static const unsigned int CHUNK_SIZE = 1 << 20; //largest single read or write
+			static const unsigned int MAX_LOADS = 32; //most files being read at once
+
+			enum State { OPENING, STATING, TRANSFERRING, CLOSING, RENAMING, DONE };
+
+			//reading or writing one file
+			struct Job {
+				bool store;
+				size_t id;
+				std::filesystem::path path; //the file read, or the temp file written
+				std::filesystem::path newPath; //the temp file is renamed to this
+				std::vector<unsigned char> content;
+				struct statx stat;
+				State state = OPENING;
+				int fd = -1;
+				size_t nextPos = 0; //start of the next chunk to read or write
+				size_t remaining = 0; //bytes not transferred yet
+				unsigned int pending = 0; //operations in flight
+				bool started = false; //the operation for the current state was pushed
+				bool failed = false;
+			};
+
+			//an operation in flight
+			struct Op {
+				Job* job;
+				size_t pos;
+				unsigned int length;
+			};
+
+			IoQueue queue;
+			std::vector<Op> ops;
+			std::vector<Op*> freeOps;
+			std::list<std::unique_ptr<Job>> active;
+
+			std::mutex lock;
+			std::condition_variable wakeIo;
+			std::condition_variable wakeMain;
+			std::thread thread;
+			bool stopping = false;
+
+			//shared with the main thread, guarded by lock
+			std::vector<std::filesystem::path> loadPaths;
+			size_t nextLoad = 0; //next file to start reading
+			size_t nextTake = 0; //next file to hand to the main thread
+			unsigned int loadsInFlight = 0;
+			std::deque<std::unique_ptr<Job>> loaded; //finished reads from nextTake onwards, null until the read is done
+			size_t readAhead; //most bytes read ahead or waiting to be written
+			size_t aheadBytes = 0;
+			std::deque<std::unique_ptr<Job>> storeQueue;
+			size_t storeBytes = 0;
+			unsigned int storesPending = 0;
+			std::deque<std::pair<size_t, bool>> storesDone;
+
+			void pushOp(Job* job, unsigned char opcode, size_t pos = 0, unsigned int length = 0) {
+				Op* op = freeOps.back();
+				freeOps.pop_back();
+				*op = Op{job, pos, length};
+
+				IoRequest request;
+				request.opcode = opcode;
+				request.fd = job->fd;
+				request.userData = (unsigned long long) op;
+
+				switch(opcode) {
+					case IORING_OP_OPENAT:
+						request.path = job->path.c_str();
+						request.flags = job->store ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+						break;
+
+					case IORING_OP_STATX:
+						request.stat = &job->stat;
+						break;
+
+					case IORING_OP_READ:
+					case IORING_OP_WRITE:
+						request.buf = job->content.data() + pos;
+						request.length = length;
+						request.offset = pos;
+						break;
+
+					case IORING_OP_RENAMEAT:
+						request.path = job->path.c_str();
+						request.newPath = job->newPath.c_str();
+						break;
+				}
+
+				queue.push(request);
+				job->pending++;
+			}
+
+			//push as many operations for the job as there is room for
+			void advance(Job* job) {
+				if(job->state == TRANSFERRING && !job->failed) {
+					while(job->nextPos < job->content.size() && !freeOps.empty()) {
+						unsigned int length = std::min(job->content.size() - job->nextPos, (size_t) CHUNK_SIZE);
+						pushOp(job, job->store ? IORING_OP_WRITE : IORING_OP_READ, job->nextPos, length);
+						job->nextPos += length;
+					}
+
+					return;
+				}
+
+				if(job->started || job->state == DONE || freeOps.empty()) {
+					return;
+				}
+
+				job->started = true;
+
+				switch(job->state) {
+					case OPENING: pushOp(job, IORING_OP_OPENAT); break;
+					case STATING: pushOp(job, IORING_OP_STATX); break;
+					case CLOSING: pushOp(job, IORING_OP_CLOSE); break;
+					case RENAMING: pushOp(job, IORING_OP_RENAMEAT); break;
+					default: break;
+				}
+			}
+
+			void setState(Job* job, State state) {
+				job->state = state;
+				job->started = false;
+			}
+
+			//something went wrong, close the file once nothing else is in flight for it
+			void fail(Job* job) {
+				job->failed = true;
+
+				if(job->pending == 0) {
+					if(job->fd >= 0) {
+						::close(job->fd);
+						job->fd = -1;
+					}
+
+					if(job->store) {
+						unlink(job->path.c_str());
+					}
+
+					setState(job, DONE);
+				}
+			}
+
+			void complete(Op* op, int result) {
+				Job* job = op->job;
+				job->pending--;
+
+				if(job->failed) {
+					fail(job);
+					return;
+				}
+
+				switch(job->state) {
+					case OPENING:
+						if(result < 0) {
+							fail(job);
+							return;
+						}
+
+						job->fd = result;
+
+						if(job->store) {
+							job->remaining = job->content.size();
+							setState(job, job->remaining > 0 ? TRANSFERRING : CLOSING);
+						} else {
+							setState(job, STATING);
+						}
+
+						break;
+
+					case STATING: {
+						if(result < 0) {
+							fail(job);
+							return;
+						}
+
+						size_t size = job->stat.stx_size;
+
+						{
+							std::lock_guard<std::mutex> guard(lock);
+							aheadBytes += size;
+						}
+
+						job->content = std::vector<unsigned char>(size);
+						job->remaining = size;
+						setState(job, size > 0 ? TRANSFERRING : CLOSING);
+						break;
+					}
+
+					case TRANSFERRING:
+						//a read of nothing means the file got shorter
+						if(result <= 0) {
+							if(result == -EINTR || result == -EAGAIN) {
+								pushOp(job, job->store ? IORING_OP_WRITE : IORING_OP_READ, op->pos, op->length);
+								return;
+							}
+
+							fail(job);
+							return;
+						}
+
+						job->remaining -= result;
+
+						//short read or write, do the rest
+						if((unsigned int) result < op->length) {
+							pushOp(job, job->store ? IORING_OP_WRITE : IORING_OP_READ, op->pos + result, op->length - result);
+						}
+
+						if(job->remaining == 0) {
+							setState(job, CLOSING);
+						}
+
+						break;
+
+					case CLOSING:
+						job->fd = -1;
+
+						if(result < 0) {
+							fail(job);
+							return;
+						}
+
+						setState(job, job->store ? RENAMING : DONE);
+						break;
+
+					case RENAMING:
+						if(result < 0) {
+							fail(job);
+							return;
+						}
+
+						setState(job, DONE);
+						break;
+
+					default:
+						break;
+				}
+			}
+
+			//hand a finished job back to the main thread
+			void finish(std::unique_ptr<Job>& job) {
+				std::lock_guard<std::mutex> guard(lock);
+
+				if(job->store) {
+					storeBytes -= job->content.size();
+					storesPending--;
+					storesDone.push_back(std::make_pair(job->id, !job->failed));
+				} else {
+					loadsInFlight--;
+					loaded[job->id - nextTake] = std::move(job);
+				}
+
+				wakeMain.notify_all();
+			}
+
+			void run() {
+				std::vector<IoCompletion> completions;
+
+				while(true) {
+					{
+						std::unique_lock<std::mutex> guard(lock);
+
+						while(true) {
+							//start reading more files while there is room in the budget, a file larger than the budget is read on its own
+							while(!stopping && nextLoad < loadPaths.size() && loadsInFlight < MAX_LOADS && aheadBytes < readAhead) {
+								auto job = std::unique_ptr<Job>(new Job());
+								job->store = false;
+								job->id = nextLoad;
+								job->path = loadPaths[nextLoad];
+								active.push_back(std::move(job));
+								loaded.push_back(nullptr);
+								loadsInFlight++;
+								nextLoad++;
+							}
+
+							while(!storeQueue.empty()) {
+								active.push_back(std::move(storeQueue.front()));
+								storeQueue.pop_front();
+							}
+
+							if(!active.empty()) {
+								break;
+							}
+
+							if(stopping) {
+								return;
+							}
+
+							wakeIo.wait(guard);
+						}
+					}
+
+					for(auto& job: active) {
+						advance(job.get());
+					}
+
+					queue.submit(freeOps.size() < ops.size());
+
+					completions.clear();
+					queue.reap(completions);
+
+					for(auto& completion: completions) {
+						Op* op = (Op*) completion.userData;
+						freeOps.push_back(op);
+						complete(op, completion.result);
+					}
+
+					for(auto iter = active.begin(); iter != active.end();) {
+						if((*iter)->state == DONE) {
+							finish(*iter);
+							iter = active.erase(iter);
+						} else {
+							iter++;
+						}
+					}
+				}
+			}
+
+		public:
+			//useRing picks io_uring over plain system calls, readAhead is roughly how many bytes may be held in memory by the engine
+			IoEngine(bool useRing, size_t readAhead): queue(QUEUE_DEPTH, useRing), readAhead(readAhead) {
+				ops = std::vector<Op>(queue.get_depth());
+
+				for(auto& op: ops) {
+					freeOps.push_back(&op);
+				}
+
+				thread = std::thread(&IoEngine::run, this);
+			}
+
+			IoEngine(const IoEngine&) = delete;
+			IoEngine& operator=(const IoEngine&) = delete;
+
+			//waits for the queued writes to finish
+			~IoEngine() {
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					stopping = true;
+				}
+
+				wakeIo.notify_all();
+				thread.join();
+			}
+
+			bool is_ring() const { return queue.is_ring(); }
+
+			//start reading the files, they are handed out with next() in the same order
+			void load(const std::vector<std::filesystem::path>& paths) {
+				std::lock_guard<std::mutex> guard(lock);
+				loadPaths = paths;
+				wakeIo.notify_all();
+			}
+
+			//wait for the next file to be read and put it in file, returns false if the file could not be read
+			bool next(MemoryFile& file) {
+				std::unique_lock<std::mutex> guard(lock);
+
+				while(loaded.empty() || loaded.front() == nullptr) {
+					wakeMain.wait(guard);
+				}
+
+				auto job = std::move(loaded.front());
+				loaded.pop_front();
+				nextTake++;
+
+				aheadBytes -= job->content.size();
+				wakeIo.notify_all();
+
+				if(job->failed) {
+					return false;
+				}
+
+				return file.open(std::move(job->content));
+			}
+
+			//write content to tempPath then rename it to path, the result is picked up later with stored()
+			//waits if too many bytes are already waiting to be written
+			void store(size_t id, const std::filesystem::path& tempPath, const std::filesystem::path& path, std::vector<unsigned char>&& content) {
+				std::unique_lock<std::mutex> guard(lock);
+
+				while(storeBytes > 0 && storeBytes + content.size() > readAhead) {
+					wakeMain.wait(guard);
+				}
+
+				auto job = std::unique_ptr<Job>(new Job());
+				job->store = true;
+				job->id = id;
+				job->path = tempPath;
+				job->newPath = path;
+				job->content = std::move(content);
+
+				storeBytes += job->content.size();
+				storesPending++;
+				storeQueue.push_back(std::move(job));
+				wakeIo.notify_all();
+			}
+
+			//get the id of a finished write and whether it succeeded, returns false if there is none
+			//if wait is true then this waits for a write that is still in flight
+			bool stored(size_t& id, bool& success, bool wait) {
+				std::unique_lock<std::mutex> guard(lock);
+
+				while(storesDone.empty()) {
+					if(!wait || storesPending == 0) {
+						return false;
+					}
+
+					wakeMain.wait(guard);
+				}
+
+				id = storesDone.front().first;
+				success = storesDone.front().second;
+				storesDone.pop_front();
+				return true;
+			}
+	};
+}
+
+#endif
+
+#endif
@@ -8,15 +8,17 @@
 #ifndef COMPRESSION_H
 #define COMPRESSION_H
 
-#include <string.h>  // for memcpy and memset
+#include <string.h>  // for memcpy, memmove and memset
 #include <stdlib.h>
 
 //#include <assert.h>
 #define assert(expr) do{}while(0)
 	
 static bool qfs_decompress(const unsigned char* src, int compressed_size, unsigned char* dst, int uncompressed_size, bool truncate);
-static int qfs_compress(const unsigned char* src, int srclen, unsigned char* dst);
-static unsigned char* _compress(const unsigned char* src, const unsigned char* srcend, unsigned char* dst, unsigned char* dstend, bool pad);
+static bool qfs_analyze(const unsigned char* src, int compressed_size, struct qfs_stats* stats);
+static int qfs_inplace_margin(const unsigned char* src, int compressed_size);
+static int qfs_compress(const unsigned char* src, int srclen, unsigned char* dst, bool fast_decode = false);
+static unsigned char* _compress(const unsigned char* src, const unsigned char* srcend, unsigned char* dst, unsigned char* dstend, bool pad, bool fast_decode);
 
 // datatype assumptions: 8-bit bytes; sizeof(int) >= 4
 
@@ -64,6 +66,44 @@ struct dbpf_compressed_file_header  // 9 bytes
 
 #define DBPF_COMPRESSION_QFS (0xFB10)
 
+// Reads one command from the compressed stream and advances src past its
+// control bytes (but not past its literals). Returns false if the command
+// is cut off by the end of the stream.
+static inline bool read_command(const unsigned char*& src, const unsigned char* src_end, int& lit, int& copy, int& offset) {
+    unsigned b0 = *src++;
+    if (b0 < 0x80) {
+        if (src == src_end) return false;
+        unsigned b1 = *src++;
+        lit = b0 & 0x03;                        // 0..3
+        copy = ((b0 & 0x1C) >> 2) + 3;          // 3..10
+        offset = ((b0 & 0x60) << 3) + b1 + 1;   // 1..1024
+    } else if (b0 < 0xC0) {
+        if (src+2 > src_end) return false;
+        unsigned b1 = *src++;
+        unsigned b2 = *src++;
+        lit = (b1 & 0xC0) >> 6;                 // 0..3
+        copy = (b0 & 0x3F) + 4;                 // 4..67
+        offset = ((b1 & 0x3F) << 8) + b2 + 1;   // 1..16384
+    } else if (b0 < 0xE0) {
+        if (src+3 > src_end) return false;
+        unsigned b1 = *src++;
+        unsigned b2 = *src++;
+        unsigned b3 = *src++;
+        lit = b0 & 0x03;                        // 0..3
+        copy = ((b0 & 0x0C) << 6) + b3 + 5;     // 5..1028
+        offset = ((b0 & 0x10) << 12) + (b1 << 8) + b2 + 1;  // 1..131072
+    } else if (b0 < 0xFC) {
+        lit = (b0 - 0xDF) * 4;                  // 4..112
+        copy = 0;
+        offset = 0;
+    } else {
+        lit = b0 - 0xFC;
+        copy = 0;
+        offset = 0;
+    }
+    return true;
+}
+
 static bool qfs_decompress(const unsigned char* src, int compressed_size, unsigned char* dst, int uncompressed_size, bool truncate) {
     const unsigned char* src_end = src + compressed_size;
     unsigned char* dst_end = dst + uncompressed_size;
@@ -87,40 +127,10 @@ static bool qfs_decompress(const unsigned char* src, int compressed_size, unsign
 
     src += sizeof(dbpf_compressed_file_header);
 
-    unsigned b0;
     do {
         int lit, copy, offset;
-        b0 = *src++;
-        if (b0 < 0x80) {
-            if (src == src_end) return false;
-            unsigned b1 = *src++;
-            lit = b0 & 0x03;                        // 0..3
-            copy = ((b0 & 0x1C) >> 2) + 3;          // 3..10
-            offset = ((b0 & 0x60) << 3) + b1 + 1;   // 1..1024
-        } else if (b0 < 0xC0) {
-            if (src+2 > src_end) return false;
-            unsigned b1 = *src++;
-            unsigned b2 = *src++;
-            lit = (b1 & 0xC0) >> 6;                 // 0..3
-            copy = (b0 & 0x3F) + 4;                 // 4..67
-            offset = ((b1 & 0x3F) << 8) + b2 + 1;   // 1..16384
-        } else if (b0 < 0xE0) {
-            if (src+3 > src_end) return false;
-            unsigned b1 = *src++;
-            unsigned b2 = *src++;
-            unsigned b3 = *src++;
-            lit = b0 & 0x03;                        // 0..3
-            copy = ((b0 & 0x0C) << 6) + b3 + 5;     // 5..1028
-            offset = ((b0 & 0x10) << 12) + (b1 << 8) + b2 + 1;  // 1..131072
-        } else if (b0 < 0xFC) {
-            lit = (b0 - 0xDF) * 4;                  // 4..112
-            copy = 0;
-            offset = 0;
-        } else {
-            lit = b0 - 0xFC;
-            copy = 0;
-            offset = 0;
-        }
+        if (!read_command(src, src_end, lit, copy, offset))
+            return false;
         if (src + lit > src_end || dst + lit + copy > dst_end) {
             if (!truncate)
                 return false;
@@ -132,7 +142,8 @@ static bool qfs_decompress(const unsigned char* src, int compressed_size, unsign
                 return false;
         }
         if (lit) {
-            memcpy(dst, src, lit);
+            // the output can catch up with the input when decompressing in place
+            memmove(dst, src, lit);
             dst += lit; src += lit;
         }
         if (copy) {
@@ -159,12 +170,177 @@ static bool qfs_decompress(const unsigned char* src, int compressed_size, unsign
     }
 }
 
+/*
+ * Upper bound on how much of a compressed stream qfs_decompress needs (with
+ * truncate set) to produce the first n bytes of output. Copy commands never
+ * take more stream bytes than they output, and literal runs take one control
+ * byte per 4 or more literals. Only streams that pad the middle with empty
+ * commands can need more, so the caller should fall back to the whole stream
+ * if decompressing the prefix fails.
+ */
+static inline int qfs_prefix_bound(int n) {
+    return (int)sizeof(dbpf_compressed_file_header) + n + n / 4 + 8;
+}
+
+/************************* parse-only stream access *************************/
+
+// One command of a compressed stream: lit bytes are taken from the stream
+// (starting at literals), then copy bytes are repeated from offset bytes
+// back in the output. size is the number of control bytes (1 to 4).
+struct qfs_command {
+    int size;
+    int lit;
+    int copy;
+    int offset;
+    const unsigned char* literals;
+};
+
+/*
+ * Walks the commands of a compressed stream without writing any output.
+ * The stream is checked the same way qfs_decompress checks it, so a stream
+ * that parses to the end without errors will also decompress.
+ */
+class CompressedInput {
+private:
+
+    const unsigned char* src;
+    const unsigned char* src_start;
+    const unsigned char* src_end;
+    int dstpos;
+    int dstsize;
+    bool error;
+
+public:
+
+    CompressedInput(const unsigned char* src_, int compressed_size) {
+        src = src_start = src_; src_end = src_ + compressed_size;
+        dstpos = 0; dstsize = 0;
+        error = true;
+
+        if (compressed_size < (int)sizeof(dbpf_compressed_file_header) + 1)
+            return;
+        const dbpf_compressed_file_header* hdr = (const dbpf_compressed_file_header*)src;
+
+        if (get(hdr->compression_id) != DBPF_COMPRESSION_QFS || (int)get(hdr->compressed_size) != compressed_size)
+            return;
+
+        dstsize = get(hdr->uncompressed_size);
+        src += sizeof(dbpf_compressed_file_header);
+        error = false;
+    }
+
+    // Reads the next command, returns false at the end of the stream or on error
+    bool next(qfs_command& cmd) {
+        if (error || src >= src_end || dstpos >= dstsize)
+            return false;
+
+        const unsigned char* control = src;
+        if (!read_command(src, src_end, cmd.lit, cmd.copy, cmd.offset)
+            || src + cmd.lit > src_end
+            || cmd.lit + cmd.copy > dstsize - dstpos
+            || (cmd.copy && cmd.offset > dstpos + cmd.lit)) {
+            error = true;
+            return false;
+        }
+
+        cmd.size = src - control;
+        cmd.literals = src;
+        src += cmd.lit;
+        dstpos += cmd.lit + cmd.copy;
+        return true;
+    }
+
+    // True if the whole stream was walked without errors (only 0xFC padding may follow the last command)
+    bool ok() const {
+        if (error || dstpos != dstsize)
+            return false;
+        const unsigned char* p = src;
+        while (p < src_end && *p == 0xFC)
+            ++p;
+        return p == src_end;
+    }
+
+    int get_src_pos() const { return src - src_start; }
+    int get_dst_pos() const { return dstpos; }
+    int get_uncompressed_size() const { return dstsize; }
+};
+
+/*
+ * Returns how many bytes beyond the uncompressed size a buffer needs so that
+ * the stream can be decompressed in place, with the compressed stream at the
+ * end of the buffer and the output written from the start. The output must
+ * never overtake the unread part of the stream, which only matters where
+ * literal runs follow long copies. Returns -1 if the stream is invalid.
+ */
+static int qfs_inplace_margin(const unsigned char* src, int compressed_size) {
+    CompressedInput input(src, compressed_size);
+
+    // the stream starts at uncompressed_size + margin - compressed_size, so after
+    // every command dst_pos <= that start + src_pos has to hold
+    int peak = 0;
+    qfs_command cmd;
+    while (input.next(cmd)) {
+        int ahead = input.get_dst_pos() - input.get_src_pos();
+        if (ahead > peak)
+            peak = ahead;
+    }
+
+    if (!input.ok())
+        return -1;
+
+    int margin = peak - (input.get_uncompressed_size() - compressed_size);
+    return margin > 0 ? margin : 0;
+}
+
+// Summary of the commands used by a compressed stream
+struct qfs_stats {
+    int compressed_size;
+    int uncompressed_size;
+    int short_copies;       // 2-byte commands, offset <= 1024 and length <= 10
+    int medium_copies;      // 3-byte commands, offset <= 16384 and length <= 67
+    int long_copies;        // 4-byte commands
+    int literal_runs;       // commands with literals only
+    int literal_bytes;
+    int copy_bytes;
+    int overlapping_copies; // offset < length, these have to be copied one byte at a time
+};
+
+// Collects stats about a compressed stream, returns false if the stream is invalid
+static bool qfs_analyze(const unsigned char* src, int compressed_size, qfs_stats* stats) {
+    memset(stats, 0, sizeof(qfs_stats));
+
+    CompressedInput input(src, compressed_size);
+    stats->compressed_size = compressed_size;
+    stats->uncompressed_size = input.get_uncompressed_size();
+
+    qfs_command cmd;
+    while (input.next(cmd)) {
+        switch (cmd.size) {
+            case 1: ++stats->literal_runs; break;
+            case 2: ++stats->short_copies; break;
+            case 3: ++stats->medium_copies; break;
+            default: ++stats->long_copies; break;
+        }
+
+        stats->literal_bytes += cmd.lit;
+        stats->copy_bytes += cmd.copy;
+
+        if (cmd.copy && cmd.offset < cmd.copy)
+            ++stats->overlapping_copies;
+    }
+
+    return input.ok();
+}
+
 /*
  * Try to compress the data and return the result in a buffer (which the
  * caller must delete). If it's uncompressable, return NULL.
+ *
+ * With fast_decode set, matches that are slow to decompress are passed
+ * over, trading some compression ratio for faster loading.
  */
  
-static int qfs_compress(const unsigned char* src, int srclen, unsigned char* dst) {
+static int qfs_compress(const unsigned char* src, int srclen, unsigned char* dst, bool fast_decode) {
     // There are only 3 byte for the uncompressed size in the header,
     // so I guess we can only compress files larger than 16MB...
     if (srclen < 14 || srclen >= 16777216) return 0;
@@ -172,7 +348,7 @@ static int qfs_compress(const unsigned char* src, int srclen, unsigned char* dst
     // We only want the compressed output if it's smaller than the
     // uncompressed.
 
-    unsigned char* dstend = _compress(src, src+srclen, dst, dst+srclen-1, false);
+    unsigned char* dstend = _compress(src, src+srclen, dst, dst+srclen-1, false, fast_decode);
 	
     if (dstend) {
         return dstend - dst;
@@ -197,6 +373,10 @@ static int qfs_compress(const unsigned char* src, int srclen, unsigned char* dst
 #define HASH_MASK 65535
 #define HASH_SHIFT 6
 
+// used instead with fast_decode, see longest_match and _compress
+#define FAST_MIN_MATCH  6
+#define FAST_MIN_OFFSET 8
+
 #define W_SIZE 131072
 #define MAX_DIST W_SIZE
 #define W_MASK (W_SIZE-1)
@@ -338,7 +518,8 @@ static inline unsigned longest_match(
     unsigned const pos,
     unsigned const remaining,
     unsigned const prev_length,
-    unsigned* pmatch_start)
+    unsigned* pmatch_start,
+    bool const fast_decode)
 {
     unsigned chain_length = MAX_CHAIN;         /* max hash chain length */
     int best_len = prev_length;                /* best match length so far */
@@ -377,6 +558,12 @@ static inline unsigned longest_match(
             match[0]          != scan[0]   ||
             match[1]          != scan[1])      continue;
 
+        /* Copies from less than FAST_MIN_OFFSET bytes back overlap
+         * themselves and have to be decompressed one byte at a time.
+         * Offset 1 is fine since it's decompressed with memset.
+         */
+        if (fast_decode && pos - cur_match > 1 && pos - cur_match < FAST_MIN_OFFSET) continue;
+
         /* It is not necessary to compare scan[2] and match[2] since they
          * are always equal when the other bytes match, given that
          * the hash keys are equal and that HASH_BITS >= 8.
@@ -401,7 +588,7 @@ static inline unsigned longest_match(
 
 /* Returns the end of the compressed data if successful, or NULL if we overran the output buffer */
 
-static unsigned char* _compress(const unsigned char* src, const unsigned char* srcend, unsigned char* dst, unsigned char* dstend, bool pad) {
+static unsigned char* _compress(const unsigned char* src, const unsigned char* srcend, unsigned char* dst, unsigned char* dstend, bool pad, bool fast_decode) {
 	
     unsigned match_start = 0;
     unsigned match_length = MIN_MATCH-1;           /* length of best match */
@@ -432,11 +619,17 @@ static unsigned char* _compress(const unsigned char* src, const unsigned char* s
 
         if (hash_head >= 0 && prev_length < MAX_LAZY && pos - hash_head <= MAX_DIST) {
 
-            match_length = longest_match (hash_head, hash, src, srcend, pos, remaining, prev_length, &match_start);
+            match_length = longest_match (hash_head, hash, src, srcend, pos, remaining, prev_length, &match_start, fast_decode);
 
             /* If we can't encode it, drop it. */
             if ((match_length <= 3 && pos - match_start > 1024) || (match_length <= 4 && pos - match_start > 16384))
                 match_length = MIN_MATCH-1;
+
+            /* Short matches split up literal runs into many small commands,
+             * each costing more to decode than the bytes it saves.
+             */
+            if (fast_decode && match_length < FAST_MIN_MATCH)
+                match_length = MIN_MATCH-1;
         }
         /* If there was a match at the previous step and the current
          * match is not better, output the previous match: